@@ -0,0 +1,230 @@
+﻿/*
+** The author disclaims copyright to this source code.
+** In place of a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+*/
+/*
+** Any feedback would be appreciated.
+** mailto:k-tak@void.in
+*/
+#ifndef ___PORTPP_BOUNDARY_H___
+#define ___PORTPP_BOUNDARY_H___
+
+#include <cstddef>
+#include <cctype>
+#include <string>
+
+
+namespace portpp {
+
+
+	/**
+	* Tells whether a byte offset in encoded text is where a character begins,
+	* without decoding the text from its start.
+	* Multi-byte charsets are resynchronized at the nearest byte which can only be a whole character.
+	*/
+	class CharBoundary
+	{
+	public:
+		enum SCHEME
+		{
+			SCHEME_UNKNOWN		= 0, // Not known by name.
+			SCHEME_STATEFUL		= 1, // ISO-2022-*, UTF-7, HZ. Bytes mean different things depending on shift state.
+			SCHEME_SINGLE		= 2, // Every byte is a character.
+			SCHEME_UTF8			= 3,
+			SCHEME_UTF16		= 4, // 2-byte units.
+			SCHEME_UTF32		= 5, // 4-byte units.
+			SCHEME_SJIS			= 6, // Shift_JIS, CP932.
+			SCHEME_EUC			= 7, // EUC-JP, EUC-KR, EUC-CN.
+			SCHEME_EUC_TW		= 8, // EUC-TW, whose SS2 sequences are 4 bytes long.
+			SCHEME_DBCS			= 9, // GBK, Big5, UHC: lead byte 0x81-0xFE and one trail byte.
+			SCHEME_GB18030		= 10, // GBK plus 4-byte sequences.
+		};
+
+	protected:
+		SCHEME					scheme_;
+		const unsigned char*	data_;
+		size_t					size_;
+		size_t					known_;	// An offset known to be a boundary, not after the last one asked.
+
+		// Length of the character at pos.
+		size_t charLength(size_t pos) const
+		{
+			unsigned char b = data_[pos];
+			size_t len = 1;
+
+			switch (scheme_) {
+			case SCHEME_SJIS:
+				len = ((b >= 0x81 && b <= 0x9F) || (b >= 0xE0 && b <= 0xFC)) ? 2 : 1;
+				break;
+			case SCHEME_EUC:
+				len = (b == 0x8F) ? 3 : (b == 0x8E || b >= 0xA1) ? 2 : 1;
+				break;
+			case SCHEME_EUC_TW:
+				len = (b == 0x8E) ? 4 : (b >= 0xA1) ? 2 : 1;
+				break;
+			case SCHEME_DBCS:
+				len = (b >= 0x81 && b <= 0xFE) ? 2 : 1;
+				break;
+			case SCHEME_GB18030:
+				if (b >= 0x81 && b <= 0xFE) {
+					len = (pos + 1 < size_ && data_[pos + 1] >= 0x30 && data_[pos + 1] <= 0x39) ? 4 : 2;
+				}
+				break;
+			default:
+				break;
+			}
+			return len;
+		}
+
+		// Whether b is always a whole character by itself, i.e. below the lowest lead and trail byte.
+		bool isSync(unsigned char b) const
+		{
+			switch (scheme_) {
+			case SCHEME_SJIS:
+			case SCHEME_DBCS:
+				return b < 0x40;
+			case SCHEME_EUC:
+			case SCHEME_EUC_TW:
+				return b < 0x80;
+			case SCHEME_GB18030:
+				return b < 0x30;
+			default:
+				return true;
+			}
+		}
+
+		// Upper case, without '-', '_' and iconv suffixes.
+		static std::string normalize(const char* encName)
+		{
+			std::string name;
+			for (const char* p = encName; *p && *p != '/'; ++p) {
+				if (*p != '-' && *p != '_') {
+					name += (char)toupper((unsigned char)*p);
+				}
+			}
+			return name;
+		}
+
+	public:
+		/**
+		* Returns true if the byte order of an encoding is told by a BOM in the text,
+		* as with UTF-16 or UTF-32 without LE/BE. The same character may then come in either order.
+		* @param encName Encoding name. iconv suffixes such as //TRANSLIT are ignored.
+		* @return true/false.
+		*/
+		static bool byteOrderFromBom(const char* encName)
+		{
+			std::string name = normalize(encName);
+			return name == "UTF16" || name == "UTF32" || name == "UCS2" || name == "UCS4" || name == "UNICODE";
+		}
+
+		/**
+		* Returns the scheme of an encoding by its name, or SCHEME_UNKNOWN.
+		* Only the common single-byte charsets are recognized by name; tell the others apart by other means.
+		* @param encName Encoding name. iconv suffixes such as //TRANSLIT are ignored.
+		* @return SCHEME_*.
+		*/
+		static SCHEME schemeOf(const char* encName)
+		{
+			std::string name = normalize(encName);
+
+			if (name.compare(0, 7, "ISO2022") == 0 || name == "UTF7" || name == "HZ" || name == "HZGB2312") {
+				return SCHEME_STATEFUL;
+			}
+			if (name == "UTF8") {
+				return SCHEME_UTF8;
+			}
+			if (name.compare(0, 5, "UTF16") == 0 || name.compare(0, 4, "UCS2") == 0 ||
+				name == "UNICODELITTLE" || name == "UNICODEBIG")
+			{
+				return SCHEME_UTF16;
+			}
+			if (name.compare(0, 5, "UTF32") == 0 || name.compare(0, 4, "UCS4") == 0) {
+				return SCHEME_UTF32;
+			}
+			if (name == "SHIFTJIS" || name == "SJIS" || name == "CP932" || name == "MSKANJI" ||
+				name == "WINDOWS31J" || name == "CSSHIFTJIS" || name == "SHIFTJISX0213")
+			{
+				return SCHEME_SJIS;
+			}
+			if (name == "EUCJP" || name == "EUCKR" || name == "EUCCN" || name == "GB2312" ||
+				name == "CP51932" || name == "EUCJPMS" || name == "EUCJISX0213" || name == "CSEUCKR")
+			{
+				return SCHEME_EUC;
+			}
+			if (name == "EUCTW") {
+				return SCHEME_EUC_TW;
+			}
+			if (name == "GBK" || name == "CP936" || name == "BIG5" || name == "BIG5HKSCS" ||
+				name == "CP950" || name == "CP949" || name == "UHC")
+			{
+				return SCHEME_DBCS;
+			}
+			if (name == "GB18030") {
+				return SCHEME_GB18030;
+			}
+			if (name == "ASCII" || name == "USASCII" || name.compare(0, 7, "ISO8859") == 0 ||
+				name.compare(0, 5, "LATIN") == 0 || name.compare(0, 5, "CP125") == 0 ||
+				name.compare(0, 10, "WINDOWS125") == 0 || name.compare(0, 4, "KOI8") == 0)
+			{
+				return SCHEME_SINGLE;
+			}
+			return SCHEME_UNKNOWN;
+		}
+
+		/**
+		* Constructor.
+		* @param scheme Scheme of the text. Neither SCHEME_UNKNOWN nor SCHEME_STATEFUL.
+		* @param data Text, which must outlive this object.
+		* @param size Size of text in bytes.
+		*/
+		CharBoundary(SCHEME scheme, const unsigned char* data, size_t size)
+			: scheme_(scheme), data_(data), size_(size), known_(0) {}
+
+		/**
+		* Returns true if a character begins at pos.
+		* Offsets must be asked in increasing order; each byte is then looked at a bounded number of times.
+		* @param pos Byte offset, less than the size of the text.
+		* @return true/false.
+		*/
+		bool at(size_t pos)
+		{
+			switch (scheme_) {
+			case SCHEME_SINGLE:
+				return true;
+			case SCHEME_UTF8:
+				return (data_[pos] & 0xC0) != 0x80;
+			case SCHEME_UTF16:
+				return (pos & 1) == 0;
+			case SCHEME_UTF32:
+				return (pos & 3) == 0;
+			default:
+				break;
+			}
+
+			// Walk back to a known boundary, then parse forward up to pos.
+			size_t start = pos;
+			while (start > known_ && !isSync(data_[start - 1])) {
+				--start;
+			}
+			size_t p = start;
+			while (p < pos) {
+				known_ = p;
+				p += charLength(p);
+			}
+			if (p == pos) {
+				known_ = pos;
+				return true;
+			}
+			return false;
+		}
+	};
+
+
+}; // end of namespace portpp
+
+#endif
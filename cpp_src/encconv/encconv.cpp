@@ -1,15 +1,280 @@
 #include "erl_nif.h"
 #include "encconv.h"
+#include "transfer.h"
+#include "boundary.h"
+#include "inflate.h"
 #include <string>
 #include <cstdlib>
 #include <memory>
 #include <iostream>
+#include <map>
+#include <list>
+#include <set>
+#include <vector>
 
 #ifdef WIN32
 #include <Windows.h>
 #endif
 
 using portpp::EncodingConverter;
+using portpp::TransferDecoder;
+using portpp::CharBoundary;
+using portpp::Inflater;
+
+// USDT probes of provider "encconv", for tracing with bpftrace, perf or SystemTap:
+//   converter_create(Handle, InEnc, OutEnc)     create_converter()
+//   converter_destroy(Handle)                   destroy_converter()
+//   converter_open(InEnc, OutEnc, Valid, Ns)    iconv_open() and the like
+//   output_alloc(Bytes, Ns)                     allocation of an output binary
+//   convert_start(InEnc, OutEnc, InBytes)       convert_binary(), convert_list(), do_convert()
+//   convert_end(InEnc, OutEnc, InBytes, OutBytes, Ns)
+//   convert_error(InEnc, OutEnc, Reason, Offset)
+// Without PORTPP_USE_SDT, they compile to nothing.
+#ifdef PORTPP_USE_SDT
+#include <sys/sdt.h>
+#define ENCCONV_PROBE1(name, a) DTRACE_PROBE1(encconv, name, a)
+#define ENCCONV_PROBE2(name, a, b) DTRACE_PROBE2(encconv, name, a, b)
+#define ENCCONV_PROBE3(name, a, b, c) DTRACE_PROBE3(encconv, name, a, b, c)
+#define ENCCONV_PROBE4(name, a, b, c, d) DTRACE_PROBE4(encconv, name, a, b, c, d)
+#define ENCCONV_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(encconv, name, a, b, c, d, e)
+// Clock for timings which only go to probes.
+#define ENCCONV_PROBE_CLOCK() enif_monotonic_time(ERL_NIF_NSEC)
+#else
+// The arguments are still referred to, so that variables kept only for probes don't
+// draw warnings, but never evaluated.
+#define ENCCONV_PROBE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define ENCCONV_PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define ENCCONV_PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define ENCCONV_PROBE4(name, a, b, c, d) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#define ENCCONV_PROBE5(name, a, b, c, d, e) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } } while (0)
+#define ENCCONV_PROBE_CLOCK() ((ErlNifTime)0)
+#endif
+
+// Loads and stores of words which scheduler threads read without taking a lock.
+#ifdef WIN32
+static inline ErlNifUInt64 atomic_load64(volatile ErlNifUInt64* p)
+{
+    return (ErlNifUInt64)InterlockedCompareExchange64((volatile LONG64*)p, 0, 0);
+}
+
+static inline void atomic_store64(volatile ErlNifUInt64* p, ErlNifUInt64 v)
+{
+    InterlockedExchange64((volatile LONG64*)p, (LONG64)v);
+}
+#else
+static inline ErlNifUInt64 atomic_load64(volatile ErlNifUInt64* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store64(volatile ErlNifUInt64* p, ErlNifUInt64 v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+
+// How to write out characters which can't be converted.
+enum FALLBACK
+{
+    FALLBACK_NONE = 0,      // Stop (or skip them with 'ignore').
+    FALLBACK_XML_CHARREF,   // &#12354;
+    FALLBACK_HTML_ENTITY,   // &copy; if HTML has a name for it, otherwise &#12354;
+    FALLBACK_REPLACE,       // A fixed byte sequence, already in the destination encoding.
+    FALLBACK_BACKSLASH_U,   // \u3042 or \U0001F600
+};
+
+// What the converted data is returned as.
+enum OUTPUT_FORM
+{
+    OUTPUT_BINARY = 0,      // A binary.
+    OUTPUT_IOLIST,          // A list of binaries of IOLIST_CHUNK_SIZE bytes.
+    OUTPUT_BYTES,           // A list of bytes (convert_list).
+    OUTPUT_CODEPOINTS,      // A list of Unicode code points.
+};
+
+// One entry of {map, [...]}: a code point, and what to write out for it instead.
+struct MapOverride
+{
+    unsigned long from;
+    unsigned long to;   // Code point, unless raw.
+    std::string bytes;  // Bytes in the destination encoding, if raw.
+    bool raw;
+
+    MapOverride() : from(0), to(0), raw(false) {}
+};
+
+struct ConvertOptions
+{
+    EncodingConverter::OPTION conv;
+    TransferDecoder::ENCODING transfer;
+    FALLBACK fallback;
+    std::string replacement;
+    OUTPUT_FORM output;
+    std::vector<MapOverride> map;
+    Inflater::FORMAT inflate;
+
+    ConvertOptions(EncodingConverter::OPTION opt = EncodingConverter::CONVERT_NONE)
+        : conv(opt), transfer(TransferDecoder::TRANSFER_NONE), fallback(FALLBACK_NONE), output(OUTPUT_BINARY),
+          inflate(Inflater::FORMAT_NONE) {}
+
+    // Option for the underlying EncodingConverter.
+    // A fallback needs to see the failures which 'ignore' would make iconv skip silently.
+    EncodingConverter::OPTION converterOption() const
+    {
+        if (fallback == FALLBACK_NONE) {
+            return conv;
+        }
+        return (EncodingConverter::OPTION)(conv & ~EncodingConverter::CONVERT_DISCARD_ILSEQ);
+    }
+};
+
+// {map, [...]} compiled for a pair of encodings: byte sequences in the source encoding
+// and what to write out for them in the destination encoding.
+class CharMap
+{
+public:
+    struct Entry
+    {
+        std::string from;
+        std::string to;
+    };
+
+private:
+    CharBoundary::SCHEME scheme_;
+    unsigned char first_[32];   // Bitmap of the first bytes of the entries.
+    std::vector<Entry> entries_;    // Sorted by from.
+    size_t longest_;                // Length of the longest from.
+
+public:
+    CharMap(CharBoundary::SCHEME scheme, const std::map<std::string, std::string>& entries) : scheme_(scheme), longest_(0)
+    {
+        memset(first_, 0, sizeof(first_));
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = entries.begin(); it != entries.end(); ++it) {
+            Entry e;
+            e.from = it->first;
+            e.to = it->second;
+            entries_.push_back(e);
+            unsigned char b = (unsigned char)e.from[0];
+            first_[b >> 3] |= (unsigned char)(1 << (b & 7));
+            longest_ = (e.from.size() > longest_) ? e.from.size() : longest_;
+        }
+    }
+
+    CharBoundary::SCHEME scheme() const { return scheme_; }
+
+    // Returns the entry whose bytes begin at p, if any. Whether p begins a character is up to the caller.
+    // Most bytes are turned away by the bitmap. The rest are looked up by binary search: the entries
+    // are whole characters, so none is a prefix of another, and the one which matches is the last
+    // entry not greater than the bytes at p.
+    const Entry* find(const unsigned char* p, size_t len) const
+    {
+        if ((first_[p[0] >> 3] & (1 << (p[0] & 7))) == 0) {
+            return 0;
+        }
+        size_t n = (len < longest_) ? len : longest_;
+        size_t lo = 0;
+        size_t hi = entries_.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries_[mid].from.compare(0, std::string::npos, (const char*)p, n) <= 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return 0;
+        }
+        const std::string& from = entries_[lo - 1].from;
+        if (from.size() <= len && memcmp(from.data(), p, from.size()) == 0) {
+            return &entries_[lo - 1];
+        }
+        return 0;
+    }
+};
+
+struct PairLatency;
+
+// Where a converter handle or a pool slot records its conversions. Looked up once, and
+// again only after the histograms have been cleared.
+struct LatencyRef
+{
+    PairLatency* pair;
+    ErlNifUInt64 generation;    // LatencyStats generation pair was looked up in.
+
+    LatencyRef() : pair(0), generation(0) {}
+};
+
+// A point in the output of a ConverterHandle and where the source was there.
+struct SourceMark
+{
+    size_t output;      // ConvertOutput::written() at the mark.
+    size_t position;    // ConverterHandle::position at the mark.
+    bool counted;       // Whether the output from here on has a character for each source character.
+                        // If not, all of it stands for the source character at position (a fallback).
+
+    SourceMark(size_t o, size_t p, bool c) : output(o), position(p), counted(c) {}
+};
+
+// What create_converter() hands out to Erlang.
+struct ConverterHandle
+{
+    EncodingConverter* conv;
+    ConvertOptions opt;
+    TransferDecoder decoder;
+    Inflater* inflater; // Applied after the transfer encoding, if the input is compressed.
+    std::string carry;  // Transfer-decoded (and inflated) bytes not yet consumed by conv.
+    std::string pending;    // Compressed bytes not yet inflated, when conversion stopped early.
+    size_t position;    // Bytes of (transfer-decoded) input consumed by conv since the last reset.
+    EncodingConverter* fbdecoder;   // Source encoding -> UCS-4BE, taken from the pool on the first fallback.
+    EncodingConverter* fbencoder;   // UTF-8 -> destination encoding, taken from the pool on the first fallback.
+    EncodingConverter* srcdecoder;  // Source encoding -> UCS-4BE ahead of conv, which then converts from UCS-4BE.
+                                    // Set for a stateful source with a fallback; see setup_handle().
+    int statefulDest;               // Whether the destination encoding has shift states. -1 if not known yet.
+    const CharMap* map;             // Compiled opt.map, if any. Shared through the pool unless ownsMap.
+    bool ownsMap;
+    std::string inenc;              // As create_converter() was given them, for the probes and the latency histograms.
+    std::string outenc;
+    LatencyRef latency;             // Histogram the conversions are counted in.
+    std::vector<SourceMark>* marks; // If set, where fallbacks went in the output. For convert_multi().
+    size_t outputCap;               // Inflating stops once the output has this many bytes, keeping
+                                    // the rest in pending. 0 for no limit.
+
+    ConverterHandle(EncodingConverter* c, const ConvertOptions& o)
+        : conv(c), opt(o), decoder(o.transfer),
+          inflater((o.inflate != Inflater::FORMAT_NONE) ? new Inflater(o.inflate) : 0),
+          position(0), fbdecoder(0), fbencoder(0), srcdecoder(0), statefulDest(-1), map(0), ownsMap(false),
+          marks(0), outputCap(0) {}
+    ~ConverterHandle();
+
+    void reset()
+    {
+        conv->reset();
+        if (srcdecoder) {
+            srcdecoder->reset();
+        }
+        decoder.reset();
+        if (inflater) {
+            inflater->reset();
+        }
+        carry.clear();
+        pending.clear();
+        position = 0;
+    }
+
+    // The converter which reads the input; its lastResult() tells why input was left over.
+    EncodingConverter* reader() const
+    {
+        return srcdecoder ? srcdecoder : conv;
+    }
+
+    // Whether input goes through carry rather than straight to conv.
+    bool buffered() const
+    {
+        return decoder.encoding() != TransferDecoder::TRANSFER_NONE || inflater != 0;
+    }
+};
 
 #if defined(WIN32) && !defined(PORTPP_USE_LIBICONV)
 static EncodingConverter* create_converter_object(
@@ -21,181 +286,2838 @@ static EncodingConverter* create_converter_object(
 static EncodingConverter* create_converter_noabort(
     const char* inenc, const char* outenc, EncodingConverter::OPTION opt)
 {
-    // If COM has not been initialized, creating an EncodingConverter instance causes the emulator to abort.
-    // We use SEH to avoid it.
-    __try {
-        return create_converter_object(inenc, outenc, opt);
-    } __except(EXCEPTION_EXECUTE_HANDLER) {
-        return 0;
+    // If COM has not been initialized, creating an EncodingConverter instance causes the emulator to abort.
+    // We use SEH to avoid it.
+    __try {
+        return create_converter_object(inenc, outenc, opt);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        return 0;
+    }
+}
+#else
+#define create_converter_noabort(INENC, OUTENC, OPT) new EncodingConverter(INENC, OUTENC, OPT)
+#endif
+
+inline static bool binary_to_string(ErlNifEnv* env, ERL_NIF_TERM term, std::string& out)
+{
+    ErlNifBinary bin;
+
+    memset(&bin, 0, sizeof(bin));
+    if (!enif_inspect_binary(env, term, &bin)) {
+        return false;
+    }
+
+    out.assign(reinterpret_cast<const char*>(bin.data), bin.size);
+    return true;
+}
+
+inline static bool string_to_binary(ErlNifEnv* env, const std::string& in, ERL_NIF_TERM& term)
+{
+    ErlNifBinary bin;
+
+    memset(&bin, 0, sizeof(bin));
+    size_t len = in.length();
+    if (!enif_alloc_binary(len, &bin)) {
+        return false;
+    }
+
+    if (len > 0) {
+        memcpy(bin.data, &in[0], len);
+    }
+
+    term = enif_make_binary(env, &bin);
+
+    return true;
+}
+
+// Size of each binary in {output, iolist} mode.
+static const size_t IOLIST_CHUNK_SIZE = 64 * 1024;
+
+// Room asked for before each call into the converter. Enough for any single character,
+// including shift sequences.
+static const size_t MIN_OUTPUT_ROOM = 32;
+
+// Collects converter output directly into Erlang binaries.
+// Either one binary grown as needed, or a list of binaries of exactly chunkSize bytes
+// (the last one shorter) which are never reallocated but the last.
+class ConvertOutput
+{
+    size_t chunkSize_;                  // 0 for a single binary.
+    std::vector<ErlNifBinary> bins_;
+    std::vector<size_t> sizes_;         // Bytes used in each of bins_.
+    size_t written_;                    // Bytes committed, including those already handed over.
+    bool failed_;
+    // Chunked mode: where reserve() lets the converter write when the last chunk has less room
+    // than asked for. commit() then fills up the chunk from it and puts the rest in new ones.
+    std::vector<unsigned char> spill_;
+    bool spilling_;
+
+    ConvertOutput(const ConvertOutput&);
+    ConvertOutput& operator=(const ConvertOutput&);
+
+    bool addBinary(size_t size)
+    {
+        ErlNifBinary bin;
+        if (!enif_alloc_binary(size, &bin)) {
+            failed_ = true;
+            return false;
+        }
+        bins_.push_back(bin);
+        sizes_.push_back(0);
+        return true;
+    }
+
+public:
+    ConvertOutput(size_t chunkSize = 0, size_t sizeHint = 0) : chunkSize_(chunkSize), written_(0), failed_(false), spilling_(false)
+    {
+        if (chunkSize_ == 0 && sizeHint > 0) {
+            unsigned char* p;
+            size_t avail;
+            reserve(sizeHint, p, avail);
+        }
+    }
+
+    ~ConvertOutput()
+    {
+        for (size_t i = 0; i < bins_.size(); ++i) {
+            enif_release_binary(&bins_[i]);
+        }
+    }
+
+    // Whether an allocation has failed. Everything written afterwards is dropped.
+    bool failed() const { return failed_; }
+
+    // Returns at least minimum bytes of free space at p.
+    bool reserve(size_t minimum, unsigned char*& p, size_t& avail)
+    {
+        if (failed_) {
+            return false;
+        }
+
+        spilling_ = false;
+        size_t left = bins_.empty() ? 0 : bins_.back().size - sizes_.back();
+        if (chunkSize_ > 0 && left < minimum && (left > 0 || minimum > chunkSize_)) {
+            spill_.resize(minimum);
+            spilling_ = true;
+            p = &spill_[0];
+            avail = minimum;
+            return true;
+        }
+
+        if (left < minimum) {
+            ErlNifTime start = ENCCONV_PROBE_CLOCK();
+            size_t size;
+            if (chunkSize_ == 0 && !bins_.empty()) {
+                // Grow the single binary geometrically.
+                size = bins_.back().size * 2;
+                if (size < sizes_.back() + minimum) {
+                    size = sizes_.back() + minimum;
+                }
+                if (!enif_realloc_binary(&bins_.back(), size)) {
+                    failed_ = true;
+                    return false;
+                }
+            } else {
+                size = (chunkSize_ > 0) ? chunkSize_ : minimum;
+                if (!addBinary(size)) {
+                    return false;
+                }
+            }
+            ENCCONV_PROBE2(output_alloc, size, ENCCONV_PROBE_CLOCK() - start);
+        }
+
+        p = bins_.back().data + sizes_.back();
+        avail = bins_.back().size - sizes_.back();
+        return true;
+    }
+
+    // Marks n bytes of the space returned by reserve() as used.
+    void commit(size_t n)
+    {
+        written_ += n;
+        if (!spilling_) {
+            sizes_.back() += n;
+            return;
+        }
+
+        spilling_ = false;
+        const unsigned char* src = spill_.empty() ? 0 : &spill_[0];
+        while (n > 0) {
+            if (bins_.empty() || sizes_.back() == bins_.back().size) {
+                ErlNifTime start = ENCCONV_PROBE_CLOCK();
+                if (!addBinary(chunkSize_)) {
+                    return;
+                }
+                ENCCONV_PROBE2(output_alloc, chunkSize_, ENCCONV_PROBE_CLOCK() - start);
+            }
+            size_t len = bins_.back().size - sizes_.back();
+            len = (n < len) ? n : len;
+            memcpy(bins_.back().data + sizes_.back(), src, len);
+            sizes_.back() += len;
+            src += len;
+            n -= len;
+        }
+    }
+
+    // Bytes written since construction (or the last rewind()), even after makeTerm().
+    size_t written() const { return written_; }
+
+    // Output written so far, for intermediate results which never go to Erlang.
+    // Valid for a single binary only.
+    const char* data() const { return bins_.empty() ? 0 : reinterpret_cast<const char*>(bins_[0].data); }
+    size_t size() const { return sizes_.empty() ? 0 : sizes_[0]; }
+
+    // Forgets the output but keeps the buffer for reuse.
+    void rewind()
+    {
+        for (size_t i = 0; i < sizes_.size(); ++i) {
+            sizes_[i] = 0;
+        }
+        written_ = 0;
+        spilling_ = false;
+    }
+
+    bool append(const void* data, size_t len)
+    {
+        const unsigned char* src = static_cast<const unsigned char*>(data);
+        while (len > 0) {
+            unsigned char* p;
+            size_t avail;
+            if (!reserve(1, p, avail)) {
+                return false;
+            }
+            size_t n = (len < avail) ? len : avail;
+            memcpy(p, src, n);
+            commit(n);
+            src += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool append(const std::string& str)
+    {
+        return append(str.data(), str.length());
+    }
+
+    // Returns the output as a list of integers: bytes, or code points if it is UCS-4BE.
+    bool makeList(ErlNifEnv* env, bool ucs4, ERL_NIF_TERM& term)
+    {
+        if (failed_) {
+            return false;
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < sizes_.size(); ++i) {
+            total += sizes_[i];
+        }
+
+        std::vector<ERL_NIF_TERM> terms;
+        terms.reserve(ucs4 ? total / 4 : total);
+        unsigned long cp = 0;
+        int nbytes = 0;
+        for (size_t i = 0; i < bins_.size(); ++i) {
+            const unsigned char* p = bins_[i].data;
+            for (size_t j = 0; j < sizes_[i]; ++j) {
+                if (!ucs4) {
+                    terms.push_back(enif_make_uint(env, p[j]));
+                    continue;
+                }
+                cp = (cp << 8) | p[j];
+                if (++nbytes == 4) {
+                    terms.push_back(enif_make_uint(env, (unsigned)cp));
+                    cp = 0;
+                    nbytes = 0;
+                }
+            }
+        }
+
+        term = enif_make_list_from_array(env, terms.empty() ? 0 : &terms[0], (unsigned)terms.size());
+        return true;
+    }
+
+    // Hands the output over to Erlang: a binary, or a list of binaries in chunked mode.
+    bool makeTerm(ErlNifEnv* env, ERL_NIF_TERM& term)
+    {
+        if (failed_) {
+            return false;
+        }
+
+        // Only the last binary can have room left; chunks before it are full.
+        std::vector<ERL_NIF_TERM> terms;
+        if (!bins_.empty() && sizes_.back() < bins_.back().size && !enif_realloc_binary(&bins_.back(), sizes_.back())) {
+            return false;
+        }
+        for (size_t i = 0; i < bins_.size(); ++i) {
+            if (chunkSize_ > 0 && sizes_[i] == 0) {
+                enif_release_binary(&bins_[i]);
+                continue;
+            }
+            terms.push_back(enif_make_binary(env, &bins_[i]));
+        }
+        bins_.clear();
+        sizes_.clear();
+
+        if (chunkSize_ > 0) {
+            term = enif_make_list_from_array(env, terms.empty() ? 0 : &terms[0], (unsigned)terms.size());
+        } else if (terms.empty()) {
+            return string_to_binary(env, std::string(), term);
+        } else {
+            term = terms[0];
+        }
+        return true;
+    }
+};
+
+inline static size_t output_chunk_size(OUTPUT_FORM form)
+{
+    return (form == OUTPUT_BINARY) ? 0 : IOLIST_CHUNK_SIZE;
+}
+
+// Turns out into the term the caller asked for.
+inline static bool output_to_term(ErlNifEnv* env, ConvertOutput& out, OUTPUT_FORM form, ERL_NIF_TERM& term)
+{
+    switch (form) {
+    case OUTPUT_BYTES:
+        return out.makeList(env, false, term);
+    case OUTPUT_CODEPOINTS:
+        return out.makeList(env, true, term);
+    default:
+        return out.makeTerm(env, term);
+    }
+}
+
+// Encoding the converter actually produces for the requested one.
+// Code points are read off UCS-4BE, provided the caller asked for a Unicode encoding at all.
+inline static const char* converter_target(const char* outenc, OUTPUT_FORM form)
+{
+    if (form != OUTPUT_CODEPOINTS) {
+        return outenc;
+    }
+    if ((toupper((unsigned char)outenc[0]) == 'U' && toupper((unsigned char)outenc[1]) == 'T' &&
+            toupper((unsigned char)outenc[2]) == 'F') ||
+        (toupper((unsigned char)outenc[0]) == 'U' && toupper((unsigned char)outenc[1]) == 'C' &&
+            toupper((unsigned char)outenc[2]) == 'S'))
+    {
+        return "UCS-4BE";
+    }
+    return 0;
+}
+
+// Runs conv over in[0..inlen) and writes the result to out.
+// On return, in and inlen are advanced past what was consumed.
+// Returns false if conv stopped before the end of the input; see conv->lastResult().
+static bool convert_into(EncodingConverter* conv, const char*& in, size_t& inlen, ConvertOutput& out)
+{
+    size_t room = MIN_OUTPUT_ROOM;
+
+    for (;;) {
+        unsigned char* p;
+        size_t avail;
+        if (!out.reserve(room, p, avail)) {
+            return false;
+        }
+
+        size_t prevlen = inlen;
+        size_t prevavail = avail;
+        bool ok = conv->convert(in, inlen, p, avail);
+        out.commit(prevavail - avail);
+        in += prevlen - inlen;
+
+        if (ok || inlen == 0) {
+            return true;
+        }
+        if (conv->lastResult() == EncodingConverter::RESULT_OUTPUT_FULL) {
+            // Ask for more room if not even a character fitted.
+            room = (prevavail == avail) ? avail * 2 : MIN_OUTPUT_ROOM;
+            continue;
+        }
+        // glibc's //IGNORE may report an error after skipping, with input left to convert.
+        // A failure is fatal only when nothing was converted.
+        if (prevlen == inlen) {
+            return false;
+        }
+        room = MIN_OUTPUT_ROOM;
+    }
+}
+
+// Writes the shift sequence to return conv to its initial state to out.
+static bool flush_into(EncodingConverter* conv, ConvertOutput& out)
+{
+    unsigned char* p;
+    size_t avail;
+    if (!out.reserve(MIN_OUTPUT_ROOM, p, avail)) {
+        return false;
+    }
+
+    size_t prevavail = avail;
+    bool ok = conv->flush(p, avail);
+    out.commit(prevavail - avail);
+    return ok;
+}
+
+inline static bool parse_transfer_encoding(ErlNifEnv* env, ERL_NIF_TERM term, TransferDecoder::ENCODING& enc)
+{
+    char encstr[32];
+
+    if (enif_get_atom(env, term, encstr, sizeof(encstr), ERL_NIF_LATIN1) <= 0) {
+        return false;
+    }
+    if (strcmp("none", encstr) == 0) {
+        enc = TransferDecoder::TRANSFER_NONE;
+    } else if (strcmp("base64", encstr) == 0) {
+        enc = TransferDecoder::TRANSFER_BASE64;
+    } else if (strcmp("quoted_printable", encstr) == 0) {
+        enc = TransferDecoder::TRANSFER_QUOTED_PRINTABLE;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+inline static bool parse_fallback(ErlNifEnv* env, ERL_NIF_TERM term, ConvertOptions& opt)
+{
+    char fbstr[32];
+    const ERL_NIF_TERM* tuple;
+    int arity;
+
+    if (enif_get_tuple(env, term, &arity, &tuple)) {
+        if (arity != 2 ||
+            enif_get_atom(env, tuple[0], fbstr, sizeof(fbstr), ERL_NIF_LATIN1) <= 0 ||
+            strcmp("replace", fbstr) != 0 ||
+            !binary_to_string(env, tuple[1], opt.replacement)) {
+            return false;
+        }
+        opt.fallback = FALLBACK_REPLACE;
+        return true;
+    }
+
+    if (enif_get_atom(env, term, fbstr, sizeof(fbstr), ERL_NIF_LATIN1) <= 0) {
+        return false;
+    }
+    if (strcmp("none", fbstr) == 0) {
+        opt.fallback = FALLBACK_NONE;
+    } else if (strcmp("xml_charref", fbstr) == 0) {
+        opt.fallback = FALLBACK_XML_CHARREF;
+    } else if (strcmp("html_entity", fbstr) == 0) {
+        opt.fallback = FALLBACK_HTML_ENTITY;
+    } else if (strcmp("backslash_u", fbstr) == 0) {
+        opt.fallback = FALLBACK_BACKSLASH_U;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+inline static bool parse_inflate(ErlNifEnv* env, ERL_NIF_TERM term, Inflater::FORMAT& format)
+{
+    char str[16];
+
+    if (enif_get_atom(env, term, str, sizeof(str), ERL_NIF_LATIN1) <= 0) {
+        return false;
+    }
+    if (strcmp("none", str) == 0) {
+        format = Inflater::FORMAT_NONE;
+    } else if (strcmp("gzip", str) == 0) {
+        format = Inflater::FORMAT_GZIP;
+    } else if (strcmp("zlib", str) == 0) {
+        format = Inflater::FORMAT_ZLIB;
+    } else if (strcmp("deflate", str) == 0) {
+        format = Inflater::FORMAT_DEFLATE;
+    } else if (strcmp("auto", str) == 0) {
+        format = Inflater::FORMAT_AUTO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// [{FromCodepoint, ToCodepoint | Bytes}]
+inline static bool parse_map(ErlNifEnv* env, ERL_NIF_TERM lst, ConvertOptions& opt)
+{
+    ERL_NIF_TERM head;
+    const ERL_NIF_TERM* tuple;
+    int arity;
+
+    if (!enif_is_list(env, lst)) {
+        return false;
+    }
+
+    while (enif_get_list_cell(env, lst, &head, &lst)) {
+        MapOverride m;
+        unsigned int from, to;
+        if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2 ||
+            !enif_get_uint(env, tuple[0], &from) || from > 0x10FFFF)
+        {
+            return false;
+        }
+        m.from = from;
+        if (enif_get_uint(env, tuple[1], &to)) {
+            if (to > 0x10FFFF) {
+                return false;
+            }
+            m.to = to;
+        } else if (binary_to_string(env, tuple[1], m.bytes)) {
+            m.raw = true;
+        } else {
+            return false;
+        }
+        opt.map.push_back(m);
+    }
+
+    return true;
+}
+
+inline static bool parse_option_list(ErlNifEnv* env, ERL_NIF_TERM lst, ConvertOptions& opt)
+{
+    char optstr[32];
+    ERL_NIF_TERM head;
+    const ERL_NIF_TERM* tuple;
+    int arity;
+
+    if (!enif_is_list(env, lst)) {
+        return false;
+    }
+
+    opt = ConvertOptions();
+
+    while (enif_get_list_cell(env, lst, &head, &lst)) {
+        if (enif_get_tuple(env, head, &arity, &tuple)) {
+            if (arity != 2 ||
+                enif_get_atom(env, tuple[0], optstr, sizeof(optstr), ERL_NIF_LATIN1) <= 0) {
+                return false;
+            }
+            if (strcmp("transfer_encoding", optstr) == 0) {
+                if (!parse_transfer_encoding(env, tuple[1], opt.transfer)) {
+                    return false;
+                }
+            } else if (strcmp("fallback", optstr) == 0) {
+                if (!parse_fallback(env, tuple[1], opt)) {
+                    return false;
+                }
+            } else if (strcmp("inflate", optstr) == 0) {
+                if (!parse_inflate(env, tuple[1], opt.inflate)) {
+                    return false;
+                }
+            } else if (strcmp("map", optstr) == 0) {
+                if (!parse_map(env, tuple[1], opt)) {
+                    return false;
+                }
+            } else if (strcmp("output", optstr) == 0) {
+                char outstr[16];
+                if (enif_get_atom(env, tuple[1], outstr, sizeof(outstr), ERL_NIF_LATIN1) <= 0) {
+                    return false;
+                }
+                if (strcmp("binary", outstr) == 0) {
+                    opt.output = OUTPUT_BINARY;
+                } else if (strcmp("iolist", outstr) == 0) {
+                    opt.output = OUTPUT_IOLIST;
+                } else if (strcmp("codepoints", outstr) == 0) {
+                    opt.output = OUTPUT_CODEPOINTS;
+                } else {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+            continue;
+        }
+        if (enif_get_atom(env, head, optstr, sizeof(optstr), ERL_NIF_LATIN1) <= 0) {
+            return false;
+        }
+        if (strcmp("translit", optstr) == 0) {
+            opt.conv = (EncodingConverter::OPTION)(opt.conv | EncodingConverter::CONVERT_TRANSLITERATE);
+        } else if (strcmp("ignore", optstr) == 0) {
+            opt.conv = (EncodingConverter::OPTION)(opt.conv | EncodingConverter::CONVERT_DISCARD_ILSEQ);
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Idle converters kept per (source, destination, option).
+// Opening a converter makes iconv load its conversion modules, which is by far
+// the most expensive part of converting a short string.
+#if defined(WIN32) && !defined(PORTPP_USE_LIBICONV)
+static const size_t MAX_IDLE_PER_PAIR = 0;  // MLang objects belong to the thread which created them.
+#else
+static const size_t MAX_IDLE_PER_PAIR = 8;
+#endif
+
+// Compiled {map, ...} kept for later converters with the same map and encodings.
+// Compiling one takes a converter round trip per entry.
+static const size_t MAX_POOLED_MAPS = 64;
+
+// Results of convert_binary() on short inputs, most recently used first.
+// Many inputs (mail subjects, names, column values) come again and again; a hit hands out
+// the binary made the first time instead of converting again.
+// Disabled (max memory 0) until configured.
+class ResultCache
+{
+private:
+    // Rough cost of an entry besides its data: the term environment and bookkeeping.
+    static const size_t ENTRY_OVERHEAD = 256;
+
+    struct Entry
+    {
+        std::pair<ErlNifUInt64, std::string> key;   // Input hash, then pair and options.
+        std::string input;  // To tell hash collisions apart.
+        ErlNifEnv* env;     // Holds result.
+        ERL_NIF_TERM result;
+        size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::pair<ErlNifUInt64, std::string>, EntryList::iterator> EntryIndex;
+
+    ErlNifMutex* lock_;
+    EntryList entries_;
+    EntryIndex index_;
+    size_t memory_;
+    size_t maxInput_;
+    size_t maxMemory_;
+    // Inputs shorter than this go through the cache: max input + 1 while it is on, 0 while
+    // it is off. A copy of the limits for accepts(), which reads it without the lock.
+    volatile ErlNifUInt64 acceptLimit_;
+    ErlNifUInt64 hits_;
+    ErlNifUInt64 misses_;
+
+    ResultCache(const ResultCache&);
+    ResultCache& operator=(const ResultCache&);
+
+    // FNV-1a
+    static ErlNifUInt64 hash(const unsigned char* data, size_t len)
+    {
+        ErlNifUInt64 h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; ++i) {
+            h = (h ^ data[i]) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void evict(size_t limit)
+    {
+        while (memory_ > limit && !entries_.empty()) {
+            Entry& e = entries_.back();
+            memory_ -= e.bytes;
+            index_.erase(e.key);
+            enif_free_env(e.env);
+            entries_.pop_back();
+        }
+    }
+
+public:
+    ResultCache()
+        : lock_(enif_mutex_create((char*)"encconv_cache")), memory_(0),
+          maxInput_(1024), maxMemory_(0), acceptLimit_(0), hits_(0), misses_(0) {}
+
+    ~ResultCache()
+    {
+        evict(0);
+        enif_mutex_destroy(lock_);
+    }
+
+    // Whether an input of len bytes should go through the cache at all.
+    // Called for every conversion, so it doesn't take the lock.
+    bool accepts(size_t len)
+    {
+        return (ErlNifUInt64)len < atomic_load64(&acceptLimit_);
+    }
+
+    // Copies the cached result for data into env. key identifies the pair and options.
+    bool lookup(ErlNifEnv* env, const std::string& key, const unsigned char* data, size_t len, ERL_NIF_TERM& result)
+    {
+        std::pair<ErlNifUInt64, std::string> k(hash(data, len), key);
+        bool found = false;
+
+        enif_mutex_lock(lock_);
+        EntryIndex::iterator it = index_.find(k);
+        if (it != index_.end() && it->second->input.compare(0, std::string::npos, (const char*)data, len) == 0) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            result = enif_make_copy(env, it->second->result);
+            found = true;
+            ++hits_;
+        } else {
+            ++misses_;
+        }
+        enif_mutex_unlock(lock_);
+
+        return found;
+    }
+
+    // Keeps a copy of result, which holds outlen bytes of converted data.
+    void insert(const std::string& key, const unsigned char* data, size_t len, ERL_NIF_TERM result, size_t outlen)
+    {
+        std::pair<ErlNifUInt64, std::string> k(hash(data, len), key);
+        size_t bytes = ENTRY_OVERHEAD + key.size() + len + outlen;
+
+        enif_mutex_lock(lock_);
+        if (bytes <= maxMemory_ && len <= maxInput_) {
+            EntryIndex::iterator it = index_.find(k);
+            if (it != index_.end()) {
+                // Another process got here first, or the hash collided. The latest one wins.
+                memory_ -= it->second->bytes;
+                enif_free_env(it->second->env);
+                entries_.erase(it->second);
+                index_.erase(it);
+            }
+            evict(maxMemory_ - bytes);
+
+            Entry e;
+            e.key = k;
+            e.input.assign((const char*)data, len);
+            e.env = enif_alloc_env();
+            e.result = enif_make_copy(e.env, result);
+            e.bytes = bytes;
+            entries_.push_front(e);
+            index_[k] = entries_.begin();
+            memory_ += bytes;
+        }
+        enif_mutex_unlock(lock_);
+    }
+
+    void clear()
+    {
+        enif_mutex_lock(lock_);
+        evict(0);
+        enif_mutex_unlock(lock_);
+    }
+
+    // Limits are in bytes. A smaller max memory takes effect right away.
+    void configure(size_t maxInput, size_t maxMemory)
+    {
+        enif_mutex_lock(lock_);
+        maxInput_ = maxInput;
+        maxMemory_ = maxMemory;
+        ErlNifUInt64 limit = (ErlNifUInt64)maxInput_;
+        atomic_store64(&acceptLimit_, (maxMemory_ == 0) ? 0 : (limit < ~(ErlNifUInt64)0) ? limit + 1 : limit);
+        evict(maxMemory_);
+        enif_mutex_unlock(lock_);
+    }
+
+    void limits(size_t& maxInput, size_t& maxMemory)
+    {
+        enif_mutex_lock(lock_);
+        maxInput = maxInput_;
+        maxMemory = maxMemory_;
+        enif_mutex_unlock(lock_);
+    }
+
+    // [{hits, N}, {misses, N}, {entries, N}, {memory, Bytes}, {max_input, Bytes}, {max_memory, Bytes}]
+    ERL_NIF_TERM info(ErlNifEnv* env)
+    {
+        enif_mutex_lock(lock_);
+        ERL_NIF_TERM ret = enif_make_list6(env,
+            enif_make_tuple2(env, enif_make_atom(env, "hits"), enif_make_uint64(env, hits_)),
+            enif_make_tuple2(env, enif_make_atom(env, "misses"), enif_make_uint64(env, misses_)),
+            enif_make_tuple2(env, enif_make_atom(env, "entries"), enif_make_uint64(env, entries_.size())),
+            enif_make_tuple2(env, enif_make_atom(env, "memory"), enif_make_uint64(env, memory_)),
+            enif_make_tuple2(env, enif_make_atom(env, "max_input"), enif_make_uint64(env, maxInput_)),
+            enif_make_tuple2(env, enif_make_atom(env, "max_memory"), enif_make_uint64(env, maxMemory_)));
+        enif_mutex_unlock(lock_);
+        return ret;
+    }
+};
+
+// Number of latency buckets. Bucket i counts latencies of 2^i to 2^(i+1) - 1 ns; the last
+// one also counts anything longer.
+static const int LATENCY_BUCKETS = 40;
+
+// Encoding pairs with a histogram of their own. Conversions between any other pairs are
+// counted together.
+static const size_t MAX_LATENCY_PAIRS = 256;
+
+// Longest encoding name kept for a histogram; the NIFs take no longer ones anyway.
+static const size_t LATENCY_NAME_SIZE = 64;
+
+// Latency of the conversions between one encoding pair.
+// The names are fixed arrays, so a stale reader never follows a freed pointer.
+struct PairLatency
+{
+    char inenc[LATENCY_NAME_SIZE];
+    char outenc[LATENCY_NAME_SIZE];
+    volatile ErlNifUInt64 buckets[LATENCY_BUCKETS];
+
+    PairLatency()
+    {
+        memset(inenc, 0, sizeof(inenc));
+        memset(outenc, 0, sizeof(outenc));
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            buckets[i] = 0;
+        }
+    }
+};
+
+// Latency histograms of conversions, one per encoding pair.
+// Histograms live in a fixed array, so a PairLatency stays valid as long as the object does;
+// clear() only hands them out again. Recording a conversion takes no lock: the buckets are
+// counted up atomically, and the lock is only taken to look a pair up.
+class LatencyStats
+{
+private:
+    typedef std::map<std::string, PairLatency*> PairIndex;
+
+    ErlNifMutex* lock_;
+    std::vector<PairLatency> pairs_;    // MAX_LATENCY_PAIRS of them, then the one for all other pairs.
+    size_t used_;                       // Leading pairs_ in use.
+    PairIndex index_;                   // pairs_ in use, by InEnc '\0' OutEnc.
+    volatile ErlNifUInt64 generation_;  // Bumped by clear(), which makes every LatencyRef stale.
+
+    LatencyStats(const LatencyStats&);
+    LatencyStats& operator=(const LatencyStats&);
+
+    PairLatency& other() { return pairs_[MAX_LATENCY_PAIRS]; }
+
+    static int bucket(ErlNifTime ns)
+    {
+        int i = 0;
+        for (ErlNifUInt64 v = (ns > 0) ? (ErlNifUInt64)ns : 0; v > 1 && i < LATENCY_BUCKETS - 1; v >>= 1) {
+            ++i;
+        }
+        return i;
+    }
+
+    static bool matches(const PairLatency& p, const char* inenc, const char* outenc)
+    {
+        return strcmp(p.inenc, inenc) == 0 && strcmp(p.outenc, outenc) == 0;
+    }
+
+    static void zero(PairLatency& p)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            atomic_store64(&p.buckets[i], 0);
+        }
+    }
+
+    ERL_NIF_TERM bucketList(ErlNifEnv* env, const PairLatency& p)
+    {
+        std::vector<ERL_NIF_TERM> buckets;
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            ErlNifUInt64 count = atomic_load64(const_cast<volatile ErlNifUInt64*>(&p.buckets[i]));
+            if (count == 0) {
+                continue;
+            }
+            ERL_NIF_TERM bound = (i == LATENCY_BUCKETS - 1) ?
+                enif_make_atom(env, "infinity") : enif_make_uint64(env, (ErlNifUInt64)1 << (i + 1));
+            buckets.push_back(enif_make_tuple2(env, bound, enif_make_uint64(env, count)));
+        }
+        return enif_make_list_from_array(env, buckets.empty() ? 0 : &buckets[0], (unsigned)buckets.size());
+    }
+
+public:
+    LatencyStats()
+        : lock_(enif_mutex_create((char*)"encconv_latency")), pairs_(MAX_LATENCY_PAIRS + 1), used_(0), generation_(1) {}
+
+    ~LatencyStats()
+    {
+        enif_mutex_destroy(lock_);
+    }
+
+    // Points ref at the histogram of the pair, unless it already does.
+    void resolve(LatencyRef& ref, const char* inenc, const char* outenc)
+    {
+        ErlNifUInt64 generation = atomic_load64(&generation_);
+        if (ref.pair && ref.generation == generation &&
+            (ref.pair == &other() || matches(*ref.pair, inenc, outenc)))
+        {
+            return;
+        }
+
+        std::string key(inenc);
+        key += '\0';
+        key += outenc;
+
+        enif_mutex_lock(lock_);
+        PairIndex::iterator it = index_.find(key);
+        if (it != index_.end()) {
+            ref.pair = it->second;
+        } else if (used_ < MAX_LATENCY_PAIRS && strlen(inenc) < LATENCY_NAME_SIZE && strlen(outenc) < LATENCY_NAME_SIZE) {
+            PairLatency& p = pairs_[used_++];
+            strcpy(p.inenc, inenc);
+            strcpy(p.outenc, outenc);
+            index_[key] = &p;
+            ref.pair = &p;
+        } else {
+            ref.pair = &other();
+        }
+        ref.generation = generation_;
+        enif_mutex_unlock(lock_);
+    }
+
+    // Counts a conversion which took ns nanoseconds. ref must have been resolved.
+    // One which ends while clear() runs may be counted for the pair the histogram goes to next.
+    void record(const LatencyRef& ref, ErlNifTime ns)
+    {
+#ifdef WIN32
+        InterlockedIncrement64((volatile LONG64*)&ref.pair->buckets[bucket(ns)]);
+#else
+        __atomic_fetch_add(&ref.pair->buckets[bucket(ns)], 1, __ATOMIC_RELAXED);
+#endif
+    }
+
+    // Forgets all pairs.
+    void clear()
+    {
+        enif_mutex_lock(lock_);
+        for (size_t i = 0; i < used_; ++i) {
+            zero(pairs_[i]);
+        }
+        zero(other());
+        used_ = 0;
+        index_.clear();
+        atomic_store64(&generation_, generation_ + 1);
+        enif_mutex_unlock(lock_);
+    }
+
+    // [{{InEnc, OutEnc} | other, [{UpperBoundNs | infinity, Count}]}], leaving out empty buckets and pairs.
+    ERL_NIF_TERM info(ErlNifEnv* env)
+    {
+        std::vector<ERL_NIF_TERM> result;
+
+        enif_mutex_lock(lock_);
+        for (PairIndex::iterator it = index_.begin(); it != index_.end(); ++it) {
+            const PairLatency& p = *it->second;
+            ERL_NIF_TERM buckets = bucketList(env, p);
+            if (enif_is_empty_list(env, buckets)) {
+                continue;
+            }
+            result.push_back(enif_make_tuple2(env,
+                enif_make_tuple2(env,
+                    enif_make_string(env, p.inenc, ERL_NIF_LATIN1),
+                    enif_make_string(env, p.outenc, ERL_NIF_LATIN1)),
+                buckets));
+        }
+        ERL_NIF_TERM buckets = bucketList(env, other());
+        if (!enif_is_empty_list(env, buckets)) {
+            result.push_back(enif_make_tuple2(env, enif_make_atom(env, "other"), buckets));
+        }
+        enif_mutex_unlock(lock_);
+
+        return enif_make_list_from_array(env, result.empty() ? 0 : &result[0], (unsigned)result.size());
+    }
+};
+
+// Bump whenever NifState or anything it holds changes, so upgrade() won't adopt the state
+// of an incompatible library. upgrade() checks the size of NifState as well, which catches
+// most changes that slip by without a bump.
+static const int NIF_STATE_VERSION = 6;
+
+// State shared by all the loaded versions of the library. Survives code upgrade: the new
+// library adopts the state of the old one. Only plain data goes here; anything which points
+// into the code of a library (such as a converter) would dangle once that library is gone.
+struct NifState
+{
+    int version;    // version and size come first, so any version of the library can read them.
+    size_t size;
+    int refs;       // Number of loaded libraries sharing this state.
+    ErlNifMutex* lock;
+    ResultCache cache;
+    LatencyStats latency;
+
+    NifState() : version(NIF_STATE_VERSION), size(sizeof(NifState)), refs(1), lock(enif_mutex_create((char*)"encconv_state")) {}
+    ~NifState()
+    {
+        enif_mutex_destroy(lock);
+    }
+};
+
+// Idle converters of this library, by pair. Unlike NifState, not handed over on upgrade:
+// the new library starts with an empty pool, and the old one empties its own in unload().
+// Converters of one (source, destination, option) kept by the pool.
+struct PoolSlot
+{
+    std::vector<EncodingConverter*> idle;
+    LatencyRef latency;     // Histogram of the last one-shot conversion through the slot.
+};
+
+struct ConverterPool
+{
+    int refs;           // Number of load() and upgrade() calls into this library not yet unloaded.
+    ErlNifUInt64 id;    // Tells the converter handles of this library from the ones of others.
+    ErlNifMutex* lock;
+    std::map<std::string, PoolSlot> slots;
+    std::map<std::string, bool> stateful;   // Whether an encoding has shift states, by name.
+    std::map<std::string, CharBoundary::SCHEME> schemes;    // search_scheme() of the encodings it had to probe.
+    std::map<std::string, const CharMap*> maps; // Compiled {map, ...}, by encodings and map_key(). Null if empty.
+    std::set<ConverterHandle*> handles;     // Converters created through this library and not destroyed yet.
+
+    ConverterPool() : refs(1), id((ErlNifUInt64)enif_monotonic_time(ERL_NIF_NSEC)), lock(enif_mutex_create((char*)"encconv_pool")) {}
+    ~ConverterPool()
+    {
+        std::map<std::string, PoolSlot>::iterator it;
+        for (it = slots.begin(); it != slots.end(); ++it) {
+            for (size_t i = 0; i < it->second.idle.size(); ++i) {
+                delete it->second.idle[i];
+            }
+        }
+        std::map<std::string, const CharMap*>::iterator mit;
+        for (mit = maps.begin(); mit != maps.end(); ++mit) {
+            delete mit->second;
+        }
+        enif_mutex_destroy(lock);
+    }
+};
+
+static ConverterPool* pool = 0;
+
+inline static std::string pool_key(const char* inenc, const char* outenc, EncodingConverter::OPTION opt)
+{
+    std::string key(inenc);
+    key += '\0';
+    key += outenc;
+    key += '\0';
+    key += (char)('0' + opt);
+    return key;
+}
+
+// Appends bytes to key, preceded by their length, so the fields which follow can't be
+// mistaken for part of them.
+inline static void append_key_field(std::string& key, const std::string& bytes)
+{
+    char buf[24];
+    sprintf(buf, "%lu:", (unsigned long)bytes.size());
+    key += buf;
+    key += bytes;
+}
+
+// Identifies the entries of opt.map.
+inline static std::string map_key(const ConvertOptions& opt)
+{
+    std::string key;
+    for (size_t i = 0; i < opt.map.size(); ++i) {
+        const MapOverride& m = opt.map[i];
+        char buf[64];
+        sprintf(buf, "%lx:%lx:%d:", m.from, m.to, (int)m.raw);
+        key += buf;
+        append_key_field(key, m.bytes);
+    }
+    return key;
+}
+
+// Identifies everything besides the input which decides the result of a conversion.
+inline static std::string cache_key(const char* inenc, const char* outenc, const ConvertOptions& opt)
+{
+    std::string key = pool_key(inenc, outenc, opt.conv);
+    key += (char)('0' + opt.transfer);
+    key += (char)('0' + opt.fallback);
+    key += (char)('0' + opt.output);
+    key += (char)('0' + opt.inflate);
+    append_key_field(key, opt.replacement);
+    key += map_key(opt);
+    return key;
+}
+
+// Creates a converter, timing it for the converter_open probe.
+static EncodingConverter* open_converter(const char* inenc, const char* outenc, EncodingConverter::OPTION opt)
+{
+    ErlNifTime start = ENCCONV_PROBE_CLOCK();
+    EncodingConverter* conv = create_converter_noabort(inenc, outenc, opt);
+    ENCCONV_PROBE4(converter_open, inenc, outenc, (conv && conv->valid()) ? 1 : 0, ENCCONV_PROBE_CLOCK() - start);
+    return conv;
+}
+
+// Returns an idle converter for the pair, or a new one. The result may be null or invalid.
+// If latency is given, it is set to what the slot of the pair holds, if anything.
+static EncodingConverter* pool_acquire(const char* inenc, const char* outenc, EncodingConverter::OPTION opt,
+    LatencyRef* latency = 0)
+{
+    if (pool) {
+        std::string key = pool_key(inenc, outenc, opt);
+        EncodingConverter* conv = 0;
+
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, PoolSlot>::iterator it = pool->slots.find(key);
+        if (it != pool->slots.end()) {
+            if (!it->second.idle.empty()) {
+                conv = it->second.idle.back();
+                it->second.idle.pop_back();
+            }
+            if (latency) {
+                *latency = it->second.latency;
+            }
+        }
+        enif_mutex_unlock(pool->lock);
+
+        if (conv) {
+            return conv;
+        }
+    }
+    return open_converter(inenc, outenc, opt);
+}
+
+// Gives conv back to the pool, or deletes it if the pool for its pair is full.
+// If latency is given, the slot keeps it for the next pool_acquire().
+static void pool_release(EncodingConverter* conv, EncodingConverter::OPTION opt, const LatencyRef* latency = 0)
+{
+    if (!conv) {
+        return;
+    }
+    if (pool && conv->valid()) {
+        std::string key = pool_key(conv->fromEncoding().c_str(), conv->toEncoding().c_str(), opt);
+
+        conv->reset();
+        enif_mutex_lock(pool->lock);
+        PoolSlot& slot = pool->slots[key];
+        if (slot.idle.size() < MAX_IDLE_PER_PAIR) {
+            slot.idle.push_back(conv);
+            conv = 0;
+        }
+        if (latency && latency->pair) {
+            slot.latency = *latency;
+        }
+        enif_mutex_unlock(pool->lock);
+    }
+    delete conv;
+}
+
+ConverterHandle::~ConverterHandle()
+{
+    delete conv;
+    delete inflater;
+    pool_release(fbdecoder, EncodingConverter::CONVERT_NONE);
+    pool_release(fbencoder, EncodingConverter::CONVERT_NONE);
+    pool_release(srcdecoder, EncodingConverter::CONVERT_NONE);
+    if (ownsMap) {
+        delete map;
+    }
+}
+
+// Makes sure the pool has a converter for each {InEnc, OutEnc} or {InEnc, OutEnc, Option} in lst.
+// A 2-tuple means the option convert_binary/3 uses. Pairs iconv doesn't know are skipped.
+// Returns false if lst is malformed.
+static bool pool_preopen(ErlNifEnv* env, ERL_NIF_TERM lst)
+{
+    ERL_NIF_TERM head;
+    const ERL_NIF_TERM* tuple;
+    int arity;
+
+    if (!enif_is_list(env, lst)) {
+        return false;
+    }
+
+    while (enif_get_list_cell(env, lst, &head, &lst)) {
+        char inenc[64];
+        char outenc[64];
+        ConvertOptions opt(EncodingConverter::CONVERT_DISCARD_ILSEQ);
+
+        if (!enif_get_tuple(env, head, &arity, &tuple) ||
+            (arity != 2 && arity != 3) ||
+            enif_get_string(env, tuple[0], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+            enif_get_string(env, tuple[1], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0 ||
+            (arity == 3 && !parse_option_list(env, tuple[2], opt)))
+        {
+            return false;
+        }
+
+        const char* target = converter_target(outenc, opt.output);
+        if (!target) {
+            continue;
+        }
+
+        // Pairs which already have an idle converter are left alone.
+        std::string key = pool_key(inenc, target, opt.converterOption());
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, PoolSlot>::const_iterator it = pool->slots.find(key);
+        bool warm = it != pool->slots.end() && !it->second.idle.empty();
+        enif_mutex_unlock(pool->lock);
+
+        if (!warm) {
+            EncodingConverter* conv = create_converter_noabort(inenc, target, opt.converterOption());
+            pool_release(conv, opt.converterOption());
+        }
+    }
+
+    return true;
+}
+
+// How characters are laid out in enc, for find() and {map, ...}. Charsets not known by name are
+// taken as single-byte if no byte begins a longer sequence. That takes 256 conversions, so
+// the result is kept in the pool.
+static CharBoundary::SCHEME search_scheme(const char* enc)
+{
+    CharBoundary::SCHEME scheme = CharBoundary::schemeOf(enc);
+    if (scheme != CharBoundary::SCHEME_UNKNOWN) {
+        return scheme;
+    }
+    if (pool) {
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, CharBoundary::SCHEME>::const_iterator it = pool->schemes.find(enc);
+        bool known = (it != pool->schemes.end());
+        if (known) {
+            scheme = it->second;
+        }
+        enif_mutex_unlock(pool->lock);
+        if (known) {
+            return scheme;
+        }
+    }
+
+    EncodingConverter* conv = pool_acquire(enc, "UCS-4BE", EncodingConverter::CONVERT_NONE);
+    bool probed = (conv && conv->valid());
+    if (probed) {
+        scheme = CharBoundary::SCHEME_SINGLE;
+        for (int i = 0; i < 256 && scheme == CharBoundary::SCHEME_SINGLE; ++i) {
+            char b = (char)i;
+            char ucs4[8];
+            size_t left = 1;
+            size_t outleft = sizeof(ucs4);
+            conv->reset();
+            conv->convert(&b, left, ucs4, outleft);
+            if (conv->lastResult() == EncodingConverter::RESULT_INCOMPLETE_INPUT ||
+                (left == 0 && outleft != sizeof(ucs4) - 4))
+            {
+                scheme = CharBoundary::SCHEME_UNKNOWN;
+            }
+        }
+    }
+    pool_release(conv, EncodingConverter::CONVERT_NONE);
+
+    // Names iconv doesn't know are not kept, so they can't fill the pool.
+    if (pool && probed) {
+        enif_mutex_lock(pool->lock);
+        pool->schemes[enc] = scheme;
+        enif_mutex_unlock(pool->lock);
+    }
+    return scheme;
+}
+
+// Returns cp in the encoding conv converts UCS-4BE to, or false if it has no such character.
+static bool encode_codepoint(EncodingConverter* conv, unsigned long cp, std::string& out)
+{
+    // Let encodings such as UTF-16 emit their BOM for a character we don't keep.
+    const char prime[] = {0, 0, 0, 'a'};
+    size_t len = sizeof(prime);
+    conv->reset();
+    conv->convert(prime, len);
+
+    char ucs4[4];
+    ucs4[0] = (char)((cp >> 24) & 0xFF);
+    ucs4[1] = (char)((cp >> 16) & 0xFF);
+    ucs4[2] = (char)((cp >> 8) & 0xFF);
+    ucs4[3] = (char)(cp & 0xFF);
+    len = sizeof(ucs4);
+    out = conv->convert(ucs4, len);
+    out += conv->flush();
+    conv->reset();
+    return len == 0 && !out.empty();
+}
+
+// Compiles h.opt.map for the encodings of h, or takes it from the pool if it has been
+// compiled before. On failure, error tells why.
+// Code points the source encoding can't express are dropped, as they never show up in the input.
+static bool compile_map(ConverterHandle& h, std::string& error)
+{
+    if (h.opt.map.empty()) {
+        return true;
+    }
+
+    std::string inenc = h.conv->fromEncoding();
+    std::string outenc = h.conv->toEncoding();
+    std::string key = pool_key(inenc.c_str(), outenc.c_str(), EncodingConverter::CONVERT_NONE) + map_key(h.opt);
+    if (pool) {
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, const CharMap*>::iterator it = pool->maps.find(key);
+        bool found = (it != pool->maps.end());
+        if (found) {
+            h.map = it->second;
+        }
+        enif_mutex_unlock(pool->lock);
+        if (found) {
+            return true;
+        }
+    }
+
+    CharBoundary::SCHEME scheme = search_scheme(inenc.c_str());
+    if (scheme == CharBoundary::SCHEME_UNKNOWN || scheme == CharBoundary::SCHEME_STATEFUL) {
+        error = "Can't apply map to the source encoding: " + inenc;
+        return false;
+    }
+    // Entries are matched as bytes, which come in one byte order only.
+    if (CharBoundary::byteOrderFromBom(inenc.c_str())) {
+        error = "Can't apply map to a source encoding whose byte order is told by a BOM: " + inenc +
+            ". Give the byte order, e.g. UTF-16LE.";
+        return false;
+    }
+
+    EncodingConverter* srcenc = pool_acquire("UCS-4BE", inenc.c_str(), EncodingConverter::CONVERT_NONE);
+    EncodingConverter* dstenc = pool_acquire("UCS-4BE", outenc.c_str(), EncodingConverter::CONVERT_NONE);
+    std::map<std::string, std::string> entries;
+    if (!srcenc || !srcenc->valid() || !dstenc || !dstenc->valid()) {
+        error = "Can't apply map to " + inenc + " or " + outenc;
+    }
+    for (size_t i = 0; i < h.opt.map.size() && error.empty(); ++i) {
+        const MapOverride& m = h.opt.map[i];
+        std::string from, to;
+        if (!encode_codepoint(srcenc, m.from, from)) {
+            continue;
+        }
+        if (m.raw) {
+            to = m.bytes;
+        } else if (!encode_codepoint(dstenc, m.to, to)) {
+            char buf[64];
+            sprintf(buf, "Can't convert U+%04lX to ", m.to);
+            error = buf + outenc;
+            break;
+        }
+        // Later entries win.
+        entries[from] = to;
+    }
+    pool_release(srcenc, EncodingConverter::CONVERT_NONE);
+    pool_release(dstenc, EncodingConverter::CONVERT_NONE);
+
+    if (!error.empty()) {
+        return false;
+    }
+    CharMap* map = entries.empty() ? 0 : new CharMap(scheme, entries);
+
+    // Another process may have compiled the same map meanwhile; the first one is kept.
+    bool shared = false;
+    if (pool) {
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, const CharMap*>::iterator it = pool->maps.find(key);
+        if (it != pool->maps.end()) {
+            delete map;
+            h.map = it->second;
+            shared = true;
+        } else if (pool->maps.size() < MAX_POOLED_MAPS) {
+            pool->maps[key] = map;
+            h.map = map;
+            shared = true;
+        }
+        enif_mutex_unlock(pool->lock);
+    }
+    if (!shared) {
+        h.map = map;
+        h.ownsMap = true;
+    }
+    return true;
+}
+
+// Readies a new handle for conversion. On failure, error tells why.
+static bool setup_handle(ConverterHandle& h, std::string& error)
+{
+    if (h.inflater && !h.inflater->valid()) {
+        error = "Can't inflate. The library may have been built without zlib.";
+        return false;
+    }
+    if (!compile_map(h, error)) {
+        return false;
+    }
+
+    // Skipping a character of a stateful source, as the fallback does, would also skip
+    // the shift sequence in front of it and leave conv in the wrong state. Such sources
+    // are decoded to UCS-4 first, which keeps the state in one converter, and the
+    // fallback is applied on the way from UCS-4 to the destination.
+    std::string inenc = h.conv->fromEncoding();
+    if (h.opt.fallback != FALLBACK_NONE && CharBoundary::schemeOf(inenc.c_str()) == CharBoundary::SCHEME_STATEFUL) {
+        EncodingConverter* decoder = pool_acquire(inenc.c_str(), "UCS-4BE", EncodingConverter::CONVERT_NONE);
+        EncodingConverter* encoder = pool_acquire("UCS-4BE", h.conv->toEncoding().c_str(), h.opt.converterOption());
+        if (!decoder || !decoder->valid() || !encoder || !encoder->valid()) {
+            pool_release(decoder, EncodingConverter::CONVERT_NONE);
+            pool_release(encoder, h.opt.converterOption());
+            error = "Can't apply fallback to the source encoding: " + inenc;
+            return false;
+        }
+        pool_release(h.conv, h.opt.converterOption());
+        h.conv = encoder;
+        h.srcdecoder = decoder;
+    }
+    return true;
+}
+
+// HTML 4 names for U+00A0..U+00FF.
+static const char* const HTML_LATIN1_ENTITIES[] = {
+    "nbsp", "iexcl", "cent", "pound", "curren", "yen", "brvbar", "sect",
+    "uml", "copy", "ordf", "laquo", "not", "shy", "reg", "macr",
+    "deg", "plusmn", "sup2", "sup3", "acute", "micro", "para", "middot",
+    "cedil", "sup1", "ordm", "raquo", "frac14", "frac12", "frac34", "iquest",
+    "Agrave", "Aacute", "Acirc", "Atilde", "Auml", "Aring", "AElig", "Ccedil",
+    "Egrave", "Eacute", "Ecirc", "Euml", "Igrave", "Iacute", "Icirc", "Iuml",
+    "ETH", "Ntilde", "Ograve", "Oacute", "Ocirc", "Otilde", "Ouml", "times",
+    "Oslash", "Ugrave", "Uacute", "Ucirc", "Uuml", "Yacute", "THORN", "szlig",
+    "agrave", "aacute", "acirc", "atilde", "auml", "aring", "aelig", "ccedil",
+    "egrave", "eacute", "ecirc", "euml", "igrave", "iacute", "icirc", "iuml",
+    "eth", "ntilde", "ograve", "oacute", "ocirc", "otilde", "ouml", "divide",
+    "oslash", "ugrave", "uacute", "ucirc", "uuml", "yacute", "thorn", "yuml"
+};
+
+// Other HTML 4 names likely to show up in text. Sorted by code point.
+static const struct { unsigned long cp; const char* name; } HTML_OTHER_ENTITIES[] = {
+    {0x0152, "OElig"}, {0x0153, "oelig"}, {0x0160, "Scaron"}, {0x0161, "scaron"},
+    {0x0178, "Yuml"}, {0x0192, "fnof"}, {0x02C6, "circ"}, {0x02DC, "tilde"},
+    {0x2013, "ndash"}, {0x2014, "mdash"}, {0x2018, "lsquo"}, {0x2019, "rsquo"},
+    {0x201A, "sbquo"}, {0x201C, "ldquo"}, {0x201D, "rdquo"}, {0x201E, "bdquo"},
+    {0x2020, "dagger"}, {0x2021, "Dagger"}, {0x2022, "bull"}, {0x2026, "hellip"},
+    {0x2030, "permil"}, {0x2039, "lsaquo"}, {0x203A, "rsaquo"}, {0x20AC, "euro"},
+    {0x2122, "trade"}
+};
+
+static const unsigned long REPLACEMENT_CHARACTER = 0xFFFD;
+
+// Formats the fallback text for code point cp. The result is ASCII.
+static std::string format_fallback(FALLBACK fallback, unsigned long cp)
+{
+    char buf[32];
+
+    if (fallback == FALLBACK_HTML_ENTITY) {
+        const char* name = 0;
+        if (cp >= 0xA0 && cp <= 0xFF) {
+            name = HTML_LATIN1_ENTITIES[cp - 0xA0];
+        } else {
+            for (size_t i = 0; i < sizeof(HTML_OTHER_ENTITIES)/sizeof(HTML_OTHER_ENTITIES[0]); ++i) {
+                if (HTML_OTHER_ENTITIES[i].cp == cp) {
+                    name = HTML_OTHER_ENTITIES[i].name;
+                    break;
+                }
+            }
+        }
+        if (name) {
+            return std::string("&") + name + ";";
+        }
+    }
+
+    if (fallback == FALLBACK_BACKSLASH_U) {
+        sprintf(buf, (cp > 0xFFFF) ? "\\U%08lX" : "\\u%04lX", cp);
+    } else {
+        sprintf(buf, "&#%lu;", cp);
+    }
+    return buf;
+}
+
+// Decodes the character at the start of in.
+// Returns its length in bytes, or 0 if the bytes are not valid in the source encoding.
+static size_t decode_one_char(ConverterHandle& h, const char* in, size_t inlen, unsigned long& cp)
+{
+    if (!h.fbdecoder) {
+        h.fbdecoder = pool_acquire(h.conv->fromEncoding().c_str(), "UCS-4BE", EncodingConverter::CONVERT_NONE);
+    }
+    if (!h.fbdecoder || !h.fbdecoder->valid()) {
+        return 0;
+    }
+
+    // No encoding we know of needs more than 8 bytes for a character.
+    for (size_t len = 1; len <= 8 && len <= inlen; ++len) {
+        unsigned char ucs4[4];
+        size_t left = len;
+        size_t outleft = sizeof(ucs4);
+
+        h.fbdecoder->reset();
+        if (h.fbdecoder->convert(in, left, ucs4, outleft) && left == 0 && outleft == 0) {
+            cp = ((unsigned long)ucs4[0] << 24) | ((unsigned long)ucs4[1] << 16) |
+                ((unsigned long)ucs4[2] << 8) | (unsigned long)ucs4[3];
+            return len;
+        }
+    }
+
+    return 0;
+}
+
+// Tells if enc has shift states (ISO-2022-JP, UTF-7 etc.), by checking whether a character
+// outside ASCII leaves anything to flush. The answer is kept by the pool for each name.
+static bool encoding_is_stateful(const std::string& enc)
+{
+    if (pool) {
+        enif_mutex_lock(pool->lock);
+        std::map<std::string, bool>::const_iterator it = pool->stateful.find(enc);
+        int known = (it == pool->stateful.end()) ? -1 : (it->second ? 1 : 0);
+        enif_mutex_unlock(pool->lock);
+        if (known >= 0) {
+            return (known != 0);
+        }
+    }
+
+    EncodingConverter* probe = pool_acquire("UTF-8", enc.c_str(), EncodingConverter::CONVERT_NONE);
+    bool stateful = false;
+    if (probe && probe->valid()) {
+        size_t len = 3;
+        probe->convert("\xE3\x81\x82", len);  // U+3042
+        stateful = (len == 0 && !probe->flush().empty());
+    }
+    pool_release(probe, EncodingConverter::CONVERT_NONE);
+
+    if (pool) {
+        enif_mutex_lock(pool->lock);
+        pool->stateful[enc] = stateful;
+        enif_mutex_unlock(pool->lock);
+    }
+    return stateful;
+}
+
+// Tells if the destination encoding of h has shift states.
+static bool destination_is_stateful(ConverterHandle& h)
+{
+    if (h.statefulDest < 0) {
+        h.statefulDest = encoding_is_stateful(h.conv->toEncoding()) ? 1 : 0;
+    }
+    return (h.statefulDest != 0);
+}
+
+// Appends the fallback for code point cp, in the destination encoding, to out.
+static bool append_fallback(ConverterHandle& h, unsigned long cp, ConvertOutput& out)
+{
+    // Return a stateful destination encoding to its initial state first.
+    // Others are left alone, as flushing would make UTF-16 and the like emit another BOM.
+    if (destination_is_stateful(h) && !flush_into(h.conv, out)) {
+        return false;
+    }
+
+    if (h.opt.fallback == FALLBACK_REPLACE) {
+        return out.append(h.opt.replacement);
+    }
+
+    if (!h.fbencoder) {
+        h.fbencoder = pool_acquire("UTF-8", h.conv->toEncoding().c_str(), EncodingConverter::CONVERT_NONE);
+        if (!h.fbencoder || !h.fbencoder->valid()) {
+            return false;
+        }
+        // Let encodings such as UTF-16 emit their BOM here rather than in the middle of the output.
+        size_t len = 1;
+        h.fbencoder->convert("a", len);
+    }
+    if (!h.fbencoder->valid()) {
+        return false;
+    }
+
+    std::string text = format_fallback(h.opt.fallback, cp);
+    size_t len = text.length();
+    return out.append(h.fbencoder->convert(text.c_str(), len)) && (len == 0);
+}
+
+// Notes in h.marks, if set, where the output starts or stops following the source
+// character by character.
+static void mark_source(ConverterHandle& h, const ConvertOutput& out, bool counted)
+{
+    if (h.marks) {
+        h.marks->push_back(SourceMark(out.written(), h.position, counted));
+    }
+}
+
+// Upper bound of the input handed to iconv() at a time. glibc's iconv() may go over all
+// the input it was given each time it stops on an error, which makes the fallback
+// path quadratic unless the input is cut into slices.
+static const size_t CONVERT_SLICE = 4096;
+
+// Converts input through h.conv, appending the result to out.
+// Characters which can't be converted are replaced according to the fallback option,
+// so conversion continues past them in the same pass.
+// inlen is set to the number of bytes which could not be converted.
+static void convert_run(ConverterHandle& h, const char* in, size_t& inlen, ConvertOutput& out)
+{
+    while (inlen > 0) {
+        size_t slice = (inlen < CONVERT_SLICE) ? inlen : CONVERT_SLICE;
+        size_t left = slice;
+        convert_into(h.conv, in, left, out);
+        inlen -= slice - left;
+        h.position += slice - left;
+
+        if (out.failed()) {
+            break;
+        }
+        if (left == 0) {
+            continue;
+        }
+        if (h.conv->lastResult() == EncodingConverter::RESULT_INCOMPLETE_INPUT && left < slice && left < inlen) {
+            // A character straddles the end of the slice.
+            continue;
+        }
+        if (h.opt.fallback == FALLBACK_NONE ||
+            h.conv->lastResult() != EncodingConverter::RESULT_INVALID_SEQUENCE)
+        {
+            break;
+        }
+
+        // Either the character has no mapping in the destination encoding,
+        // or the bytes are not valid in the source encoding. The latter is replaced byte by byte.
+        unsigned long cp = REPLACEMENT_CHARACTER;
+        size_t charlen = decode_one_char(h, in, inlen, cp);
+        if (charlen == 0) {
+            charlen = 1;
+            cp = REPLACEMENT_CHARACTER;
+        }
+        mark_source(h, out, false);
+        if (!append_fallback(h, cp, out)) {
+            break;
+        }
+        in += charlen;
+        inlen -= charlen;
+        h.position += charlen;
+        mark_source(h, out, true);
+    }
+}
+
+// convert_run() for a handle with a source decoder: decodes input to UCS-4 a slice at a
+// time and converts that through h.conv. Invalid input bytes are replaced one by one.
+static void convert_decoded(ConverterHandle& h, const char* in, size_t& inlen, ConvertOutput& out)
+{
+    char ucs4[CONVERT_SLICE];
+    while (inlen > 0) {
+        size_t left = inlen;
+        size_t ucs4left = sizeof(ucs4);
+        h.srcdecoder->convert(in, left, ucs4, ucs4left);
+        size_t used = inlen - left;
+
+        // The fallback takes care of everything conv can't convert, so conv gets through
+        // the whole slice unless out fails.
+        size_t position = h.position;
+        size_t ucs4len = sizeof(ucs4) - ucs4left;
+        convert_run(h, ucs4, ucs4len, out);
+        if (out.failed() || ucs4len > 0) {
+            break;
+        }
+        h.position = position + used;
+        in += used;
+        inlen -= used;
+
+        if (left == 0 || h.srcdecoder->lastResult() == EncodingConverter::RESULT_OUTPUT_FULL) {
+            continue;
+        }
+        if (h.srcdecoder->lastResult() != EncodingConverter::RESULT_INVALID_SEQUENCE) {
+            break;
+        }
+        mark_source(h, out, false);
+        if (!append_fallback(h, REPLACEMENT_CHARACTER, out)) {
+            break;
+        }
+        ++in;
+        --inlen;
+        ++h.position;
+        mark_source(h, out, true);
+    }
+}
+
+// Same as convert_run(), but characters in h.map are written out as the map says.
+// in must begin at a character boundary.
+static void convert_chunk(ConverterHandle& h, const char* in, size_t& inlen, ConvertOutput& out)
+{
+    if (h.srcdecoder) {
+        convert_decoded(h, in, inlen, out);
+        return;
+    }
+    if (!h.map) {
+        convert_run(h, in, inlen, out);
+        return;
+    }
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+    size_t total = inlen;
+    size_t done = 0;
+    size_t at = 0;
+    CharBoundary boundary(h.map->scheme(), p, total);
+    for (;;) {
+        // Find the next character in the map...
+        const CharMap::Entry* e = 0;
+        for (; at < total; ++at) {
+            e = h.map->find(p + at, total - at);
+            if (e && boundary.at(at)) {
+                break;
+            }
+            e = 0;
+        }
+
+        // ...convert what comes before it as usual...
+        size_t runlen = at - done;
+        size_t left = runlen;
+        convert_run(h, in + done, left, out);
+        done += runlen - left;
+        if (left > 0 || !e || out.failed()) {
+            break;
+        }
+
+        // ...and write it out as mapped.
+        if (destination_is_stateful(h) && !flush_into(h.conv, out)) {
+            break;
+        }
+        if (!out.append(e->to)) {
+            break;
+        }
+        done += e->from.size();
+        h.position += e->from.size();
+        at = done;
+    }
+    inlen = total - done;
+}
+
+// Longest run of undecodable bytes kept between two calls. Anything longer can't be
+// a partial character and means the converter got stuck on invalid input.
+static const size_t MAX_CARRY = 64;
+
+// Whether the conversion through a buffered handle can't go on: conv stopped on an invalid
+// sequence, or holds back more bytes than a character can have. Input must not be taken
+// any further then, as it could never be converted.
+static bool conversion_stuck(const ConverterHandle& h)
+{
+    if (h.carry.size() > MAX_CARRY) {
+        return true;
+    }
+    return !h.carry.empty() && (h.opt.conv & EncodingConverter::CONVERT_DISCARD_ILSEQ) == 0 &&
+        h.reader()->lastResult() == EncodingConverter::RESULT_INVALID_SEQUENCE;
+}
+
+// Inflated bytes converted at a time.
+static const size_t INFLATE_WINDOW = 16 * 1024;
+
+// Inflates compressed input and converts the result window by window. The window is
+// reused for the whole stream, with the bytes carried over from the previous one at its
+// front, so memory stays the same however large the stream is. (iconv wants its input
+// in one piece, which is why the window is not a ring.)
+// Compressed input which is not inflated because conversion stopped early is kept in
+// h.pending, and goes first the next time.
+static void inflate_chunk(ConverterHandle& h, const char* in, size_t inlen, ConvertOutput& out)
+{
+    std::string input;
+    if (!h.pending.empty()) {
+        input.swap(h.pending);
+        input.append(in, inlen);
+        in = input.data();
+        inlen = input.size();
+    }
+
+    char window[INFLATE_WINDOW];
+    while (!conversion_stuck(h) && !out.failed() && !h.inflater->failed() &&
+        (h.outputCap == 0 || out.written() < h.outputCap))
+    {
+        size_t winlen = h.carry.size();
+        size_t winleft = sizeof(window) - winlen;
+        size_t prevlen = inlen;
+
+        memcpy(window, h.carry.data(), winlen);
+        h.inflater->decode(in, inlen, window + winlen, winleft);
+        in += prevlen - inlen;
+        if (winleft == sizeof(window) - winlen) {
+            // Everything so far is out.
+            break;
+        }
+        winlen = sizeof(window) - winleft;
+
+        size_t convlen = winlen;
+        convert_chunk(h, window, convlen, out);
+        h.carry.assign(window + winlen - convlen, convlen);
+    }
+    if (!h.inflater->failed()) {
+        h.pending.assign(in, inlen);
+    }
+}
+
+// Converts input through the handle, appending the result to out.
+// inlen is set to the number of input bytes (or, for transfer-encoded input, decoded bytes)
+// which could not be converted.
+static void convert_handle(ConverterHandle& h, const char* in, size_t& inlen, ConvertOutput& out)
+{
+    if (!h.buffered()) {
+        convert_chunk(h, in, inlen, out);
+        return;
+    }
+    if (h.decoder.encoding() == TransferDecoder::TRANSFER_NONE) {
+        inflate_chunk(h, in, inlen, out);
+        inlen = h.carry.size();
+        return;
+    }
+
+    if (h.inflater && inlen == 0) {
+        // Go on with what outputCap held back.
+        inflate_chunk(h, in, 0, out);
+    }
+
+    // Decode the transfer encoding block by block and feed each block to the converter
+    // directly, so the decoded form of the whole input never exists in memory.
+    char buf[4096];
+    while (inlen > 0 && !conversion_stuck(h) && !out.failed() &&
+        !(h.inflater && h.inflater->failed()))
+    {
+        // Compressed data goes through the inflater, which has its own window.
+        size_t buflen = h.inflater ? 0 : h.carry.size();
+        size_t bufleft = sizeof(buf) - buflen;
+        size_t prevlen = inlen;
+
+        memcpy(buf, h.carry.data(), buflen);
+        h.decoder.decode(in, inlen, buf + buflen, bufleft);
+        in += prevlen - inlen;
+        buflen = sizeof(buf) - bufleft;
+
+        if (h.inflater) {
+            inflate_chunk(h, buf, buflen, out);
+            continue;
+        }
+        size_t convlen = buflen;
+        convert_chunk(h, buf, convlen, out);
+        h.carry.assign(buf + buflen - convlen, convlen);
+    }
+    inlen = h.carry.size();
+}
+
+// Gives the converter of a ConverterHandle back to the pool when going out of scope.
+class PooledConverter
+{
+    ConverterHandle& h_;
+
+public:
+    explicit PooledConverter(ConverterHandle& h) : h_(h) {}
+    ~PooledConverter()
+    {
+        pool_release(h_.conv, h_.opt.converterOption(), &h_.latency);
+        h_.conv = 0;
+    }
+};
+
+// Why a conversion through h did not get to the end of its input, or null if it did.
+// result is how h.conv stopped; inlen is the number of bytes left unconverted.
+// Data the inflater rejected may have decoded to garbage before it noticed, so a corrupt
+// stream comes first. The inflater also stops early when conversion gets stuck on an invalid
+// sequence, so only a character or stream cut short at the end of the input is incomplete.
+static const char* input_error(const ConverterHandle& h, EncodingConverter::RESULT result, size_t inlen)
+{
+    bool strict = (h.opt.conv & EncodingConverter::CONVERT_DISCARD_ILSEQ) == 0;
+    if (h.inflater && h.inflater->failed()) {
+        return "corrupt_stream";
+    }
+    if (inlen > 0 && strict && result == EncodingConverter::RESULT_INVALID_SEQUENCE) {
+        return "invalid_sequence";
+    }
+    if (h.inflater && !h.inflater->ended()) {
+        return "incomplete";
+    }
+    if (inlen > 0 && strict) {
+        return (result == EncodingConverter::RESULT_INCOMPLETE_INPUT) ? "incomplete" : "invalid_sequence";
+    }
+    return 0;
+}
+
+// Flushes the handle and builds the result of a one-shot conversion.
+// inlen is the number of input bytes left unconverted.
+// reason is set to why the conversion failed, or null if it didn't.
+static ERL_NIF_TERM finish_conversion(ErlNifEnv* env, ConverterHandle& h, const ConvertOptions& opt, size_t inlen, ConvertOutput& out,
+	const char*& reason)
+{
+	EncodingConverter::RESULT result = h.reader()->lastResult();
+	flush_into(h.conv, out);
+
+	ERL_NIF_TERM term = 0;
+	if (!output_to_term(env, out, opt.output, term)) {
+		// Running out of memory?
+		reason = "no_memory";
+		return enif_make_tuple2(env, enif_make_atom(env, "error"),
+			enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
+	}
+
+	reason = input_error(h, result, inlen);
+	if (reason) {
+		// The input was not fully consumed.
+		// Return what was converted so far and where it stopped, so the caller can resume from there.
+		return enif_make_tuple3(
+			env,
+			enif_make_atom(env, "error"),
+			enif_make_tuple2(env, enif_make_atom(env, reason), enif_make_uint64(env, h.position)),
+			term);
+	}
+
+	return enif_make_tuple3(env, enif_make_atom(env, "ok"), term, enif_make_uint64(env, inlen));
+}
+
+// Converts a list of bytes through the handle, reading it in batches.
+// inlen is set as convert_handle() does. Returns false if lst is not a list of bytes.
+static bool convert_byte_list(ErlNifEnv* env, ConverterHandle& h, ERL_NIF_TERM lst, size_t& inlen, ConvertOutput& out)
+{
+    char buf[4096];
+    size_t buflen = 0;
+    bool stopped = false;
+    bool more = true;
+    ERL_NIF_TERM head;
+
+    inlen = 0;
+    for (;;) {
+        more = (enif_get_list_cell(env, lst, &head, &lst) != 0);
+        if (more) {
+            unsigned byte;
+            if (!enif_get_uint(env, head, &byte) || byte > 255) {
+                return false;
+            }
+            if (stopped) {
+                // Just count what is left.
+                ++inlen;
+                continue;
+            }
+            buf[buflen++] = (char)byte;
+            if (buflen < sizeof(buf)) {
+                continue;
+            }
+        } else if (stopped || buflen == 0) {
+            break;
+        }
+
+        size_t left = buflen;
+        convert_handle(h, buf, left, out);
+        buflen = 0;
+        if (h.buffered()) {
+            // Unconverted bytes are carried over inside the handle.
+            stopped = (conversion_stuck(h) || (h.inflater && h.inflater->failed()));
+            inlen = left;
+        } else if (left > 0 && more && left <= MAX_CARRY &&
+            h.reader()->lastResult() == EncodingConverter::RESULT_INCOMPLETE_INPUT)
+        {
+            // A character straddles the end of the batch.
+            memmove(buf, buf + sizeof(buf) - left, left);
+            buflen = left;
+        } else {
+            stopped = (left > 0);
+            inlen = left;
+        }
+        if (!more || out.failed()) {
+            break;
+        }
+    }
+
+    // Stopping early on an output failure leaves the rest unchecked.
+    return out.failed() || enif_is_empty_list(env, lst);
+}
+
+inline static ERL_NIF_TERM convert_internal(
+    ErlNifEnv* env,
+    ERL_NIF_TERM input,
+    const char* inenc, const char* outenc, const ConvertOptions& opt)
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+    EncodingConverter* conv = 0;
+	ERL_NIF_TERM ret = 0;
+	ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+	const char* failure = 0;	// Why the conversion failed, as the convert_error probe tells it.
+	size_t failpos = 0;
+	LatencyRef latency;			// Histogram of the pair, as the pool slot remembers it.
+	bool timed = false;			// Only conversions which got a valid converter are counted.
+
+	ErlNifBinary in;
+	unsigned listlen = 0;
+	memset(&in, 0, sizeof(in));
+	bool binary =(enif_inspect_binary(env, input, &in) != 0);
+	bool list = !binary && enif_get_list_length(env, input, &listlen);
+	size_t insize = binary ? in.size : listlen;
+	size_t outsize = 0;
+	ENCCONV_PROBE3(convert_start, inenc, outenc, insize);
+
+	do {
+		// Short binaries may have been converted before.
+		std::string cachekey;
+		bool cacheable = st && opt.output == OUTPUT_BINARY && binary && st->cache.accepts(in.size);
+		if (cacheable) {
+			cachekey = cache_key(inenc, outenc, opt);
+			if (st->cache.lookup(env, cachekey, in.data, in.size, ret)) {
+				int arity;
+				const ERL_NIF_TERM* tuple;
+				ErlNifBinary outbin;
+				if (enif_get_tuple(env, ret, &arity, &tuple) && arity == 3 && enif_inspect_binary(env, tuple[1], &outbin)) {
+					outsize = outbin.size;
+				}
+				break;
+			}
+		}
+
+		const char* target = converter_target(outenc, opt.output);
+		if (!target) {
+			failure = "no_unicode_target";
+			ret = enif_make_tuple2(
+				env,
+				enif_make_atom(env, "error"),
+				enif_make_string(env, (std::string("Code points need a Unicode destination encoding: ") + outenc).c_str(), ERL_NIF_LATIN1));
+			break;
+		}
+
+		conv = pool_acquire(inenc, target, opt.converterOption(), &latency);
+		if (!conv) {
+			// Failed to create a converter. Probably initialize() has not been called yet.
+			failure = "no_converter";
+			ret = enif_make_tuple2(
+				env,
+				enif_make_atom(env, "error"),
+				enif_make_string(env, "Can't create a converter. Probably you haven't called initialize() yet.", ERL_NIF_LATIN1));
+			break;
+		}
+		if (!conv->valid()) {
+			// The converter is not valid. Any of the specified encodings may be wrong/unsupported.
+			failure = "unsupported";
+			ret = enif_make_tuple2(
+				env,
+				enif_make_atom(env, "error"),
+				enif_make_string(env,
+					(std::string("Unknown encoding or conversion not supported: ") + inenc + " or " + outenc).c_str(), ERL_NIF_LATIN1));
+			break;
+		}
+
+		// Do conversion
+		if (st) {
+			st->latency.resolve(latency, inenc, outenc);
+			timed = true;
+		}
+		ConverterHandle h(conv, opt);
+		conv = 0;
+		h.latency = latency;
+		PooledConverter pooled(h);
+
+		std::string error;
+		if (!setup_handle(h, error)) {
+			failure = "bad_option";
+			ret = enif_make_tuple2(
+				env,
+				enif_make_atom(env, "error"),
+				enif_make_string(env, error.c_str(), ERL_NIF_LATIN1));
+			break;
+		}
+
+		size_t inlen = 0;
+		if (list) {
+			ConvertOutput out(output_chunk_size(opt.output), listlen);
+			if (convert_byte_list(env, h, input, inlen, out)) {
+				ret = finish_conversion(env, h, opt, inlen, out, failure);
+				failpos = h.position;
+				outsize = out.written();
+				break;
+			}
+			// Not a flat list of bytes. Any other iolist is taken as the binary it makes up,
+			// and converted from the start again.
+			if (!enif_inspect_iolist_as_binary(env, input, &in)) {
+				failure = "badarg";
+				ret = enif_make_badarg(env);
+				break;
+			}
+			h.reset();
+			binary = true;
+		}
+		if (binary) {
+			ConvertOutput out(output_chunk_size(opt.output), in.size);
+			inlen = in.size;
+			convert_handle(h, reinterpret_cast<const char*>(in.data), inlen, out);
+			ret = finish_conversion(env, h, opt, inlen, out, failure);
+			failpos = h.position;
+			outsize = out.written();
+
+			int arity;
+			const ERL_NIF_TERM* tuple;
+			ErlNifBinary outbin;
+			if (cacheable && enif_get_tuple(env, ret, &arity, &tuple) && arity == 3 &&
+				enif_is_identical(tuple[0], enif_make_atom(env, "ok")) &&
+				enif_inspect_binary(env, tuple[1], &outbin))
+			{
+				st->cache.insert(cachekey, in.data, in.size, ret, outbin.size);
+			}
+		} else {
+			failure = "badarg";
+			ret = enif_make_badarg(env);
+		}
+	} while (false);
+
+	if (conv) delete conv;
+
+	ErlNifTime elapsed = enif_monotonic_time(ERL_NIF_NSEC) - start;
+	if (failure) {
+		ENCCONV_PROBE4(convert_error, inenc, outenc, failure, failpos);
+	}
+	ENCCONV_PROBE5(convert_end, inenc, outenc, insize, outsize, elapsed);
+	if (timed) {
+		st->latency.record(latency, elapsed);
+	}
+	return ret;
+}
+
+static ERL_NIF_TERM convert_binary_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary in;
+    char inenc[64];
+    char outenc[64];
+
+    if (!enif_inspect_binary(env, argv[0], &in) ||
+        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0) {
+            return enif_make_badarg(env);
+    }
+
+    return convert_internal(env, argv[0], inenc, outenc, ConvertOptions(EncodingConverter::CONVERT_DISCARD_ILSEQ));
+}
+
+static ERL_NIF_TERM convert_binary_opt_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary in;
+    char inenc[64];
+    char outenc[64];
+    ConvertOptions opt;
+
+    if (!enif_inspect_binary(env, argv[0], &in) ||
+        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (!parse_option_list(env, argv[3], opt)) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, "Unknown option.", ERL_NIF_LATIN1));
+    }
+
+    return convert_internal(env, argv[0], inenc, outenc, opt);
+}
+
+static ERL_NIF_TERM convert_list_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char inenc[64];
+    char outenc[64];
+    ConvertOptions opt(EncodingConverter::CONVERT_DISCARD_ILSEQ);
+
+    if (!enif_is_list(env, argv[0]) ||
+        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+    opt.output = OUTPUT_BYTES;
+    return convert_internal(env, argv[0], inenc, outenc, opt);
+}
+
+static ERL_NIF_TERM convert_list_opt_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char inenc[64];
+    char outenc[64];
+    ConvertOptions opt;
+
+    if (!enif_is_list(env, argv[0]) ||
+        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (!parse_option_list(env, argv[3], opt)) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, "Unknown option.", ERL_NIF_LATIN1));
+    }
+
+    // Lists in, lists out.
+    if (opt.output != OUTPUT_CODEPOINTS) {
+        opt.output = OUTPUT_BYTES;
+    }
+    return convert_internal(env, argv[0], inenc, outenc, opt);
+}
+
+// Input bytes decoded at a time by convert_multi(). Its UCS-4 form is about 4 times as large;
+// compressed input is inflated up to that much at a time.
+static const size_t MULTI_BLOCK = 16 * 1024;
+
+// UCS-4BE form of U+FFFD, what convert_multi() decodes invalid input to with {fallback, {replace, Bin}}.
+// Bin is only meaningful in the destination encodings.
+static const char MULTI_REPLACEMENT[] = {0, 0, (char)0xFF, (char)0xFD};
+
+// One destination of convert_multi().
+struct MultiTarget
+{
+    ConverterHandle* h;
+    ConvertOutput* out;
+    bool stopped;       // h failed on a character.
+    size_t offset;      // Where in the source, if stopped.
+    ERL_NIF_TERM error; // Set if h could not be created.
+
+    MultiTarget() : h(0), out(0), stopped(false), offset(0), error(0) {}
+};
+
+// Gives the converters of convert_multi() back to the pool.
+class MultiTargets
+{
+    MultiTargets(const MultiTargets&);
+    MultiTargets& operator=(const MultiTargets&);
+
+public:
+    std::vector<MultiTarget> targets;
+
+    MultiTargets() {}
+    ~MultiTargets()
+    {
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (targets[i].h) {
+                pool_release(targets[i].h->conv, targets[i].h->opt.converterOption());
+                targets[i].h->conv = 0;
+                delete targets[i].h;
+            }
+            delete targets[i].out;
+        }
+    }
+};
+
+// No encoding we know of needs more than this for a character, shift sequences included.
+static const size_t MAX_CHAR_BYTES = 8;
+
+// Offset in the (transfer-decoded and inflated) input of the character which comes chars
+// characters after the one at from. Only what is needed of the input is decoded again:
+// up to a few bytes past the character, and from the start only for a stateful source,
+// whose decoder has to go through the shift sequences before from.
+static size_t multi_source_offset(const char* inenc, const ConvertOptions& opt, const ErlNifBinary& in, size_t from, size_t chars)
+{
+    const char* src = reinterpret_cast<const char*>(in.data);
+    size_t srclen = in.size;
+    std::string transferred;
+
+    if (opt.transfer != TransferDecoder::TRANSFER_NONE) {
+        // Only on the error path; the decoded input is no larger than the input.
+        TransferDecoder decoder(opt.transfer);
+        char buf[4096];
+        size_t inleft = in.size;
+        while (inleft > 0) {
+            size_t prevlen = inleft;
+            size_t bufleft = sizeof(buf);
+            decoder.decode(in.data + (in.size - inleft), inleft, buf, bufleft);
+            transferred.append(buf, sizeof(buf) - bufleft);
+            if (prevlen == inleft) {
+                break;
+            }
+        }
+        src = transferred.data();
+        srclen = transferred.size();
+    }
+
+    bool stateful = encoding_is_stateful(inenc);
+    size_t base = stateful ? 0 : from;              // Offset of src in the decoded input.
+    size_t limit = from + (chars + 1) * MAX_CHAR_BYTES;
+    std::string inflated;
+    if (opt.inflate != Inflater::FORMAT_NONE) {
+        Inflater inflater(opt.inflate);
+        char buf[4096];
+        size_t inleft = srclen;
+        size_t total = 0;
+        while (total < limit) {
+            size_t bufleft = sizeof(buf);
+            inflater.decode(src + (srclen - inleft), inleft, buf, bufleft);
+            size_t len = sizeof(buf) - bufleft;
+            if (len == 0) {
+                break;
+            }
+            if (total + len > base) {
+                size_t skip = (base > total) ? base - total : 0;
+                inflated.append(buf + skip, len - skip);
+            }
+            total += len;
+        }
+        src = inflated.data();
+        srclen = inflated.size();
+    } else {
+        size_t end = (limit < srclen) ? limit : srclen;
+        if (base > end) {
+            return from;
+        }
+        src += base;
+        srclen = end - base;
+    }
+    if (from - base > srclen) {
+        return from;
+    }
+
+    EncodingConverter* conv = pool_acquire(inenc, "UCS-4BE", opt.converterOption());
+    size_t offset = 0;  // In src.
+    if (conv && conv->valid()) {
+        char ucs4[4096];
+        // Bring a stateful decoder to the state it had at from. Bytes it can't decode were
+        // taken by a fallback.
+        while (offset < from - base) {
+            size_t left = from - base - offset;
+            size_t outleft = sizeof(ucs4);
+            conv->convert(src + offset, left, ucs4, outleft);
+            size_t used = (from - base - offset) - left;
+            offset += used;
+            if (used == 0) {
+                if (conv->lastResult() != EncodingConverter::RESULT_INVALID_SEQUENCE) {
+                    break;
+                }
+                ++offset;
+            }
+        }
+        offset = from - base;
+
+        // iconv stops with a full output buffer right after the character wanted.
+        while (chars > 0 && offset < srclen) {
+            size_t outlen = (chars * 4 < sizeof(ucs4)) ? chars * 4 : sizeof(ucs4);
+            size_t outleft = outlen;
+            size_t left = srclen - offset;
+            conv->convert(src + offset, left, ucs4, outleft);
+            size_t used = (srclen - offset) - left;
+            offset += used;
+            chars -= (outlen - outleft) / 4;
+            if (used == 0) {
+                break;
+            }
+        }
+    }
+    pool_release(conv, opt.converterOption());
+
+    return base + offset;
+}
+
+// Offset in the (transfer-decoded and inflated) input of the character a destination of
+// convert_multi() stopped on, output bytes into the UCS-4 block marks were taken for.
+static size_t multi_stop_offset(const char* inenc, const ConvertOptions& opt, const ErlNifBinary& in,
+    const std::vector<SourceMark>& marks, size_t output)
+{
+    // The first mark is at the start of the block.
+    size_t i = marks.size() - 1;
+    while (i > 0 && marks[i].output > output) {
+        --i;
+    }
+    const SourceMark& m = marks[i];
+    if (!m.counted) {
+        return m.position;
+    }
+    return multi_source_offset(inenc, opt, in, m.position, (output - m.output) / 4);
+}
+
+static ERL_NIF_TERM convert_multi_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary in;
+    char inenc[64];
+    ConvertOptions opt;
+    unsigned count = 0;
+
+    if (!enif_inspect_binary(env, argv[0], &in) ||
+        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
+        !enif_get_list_length(env, argv[2], &count))
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (!parse_option_list(env, argv[3], opt)) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, "Unknown option.", ERL_NIF_LATIN1));
+    }
+
+    // The source is decoded once to UCS-4BE...
+    ConvertOptions decopt(opt);
+    decopt.output = OUTPUT_BINARY;
+    if (decopt.fallback == FALLBACK_REPLACE) {
+        decopt.replacement.assign(MULTI_REPLACEMENT, sizeof(MULTI_REPLACEMENT));
+    }
+    EncodingConverter* conv = pool_acquire(inenc, "UCS-4BE", decopt.converterOption());
+    if (!conv) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, "Can't create a converter. Probably you haven't called initialize() yet.", ERL_NIF_LATIN1));
+    }
+    ConverterHandle dh(conv, decopt);
+    PooledConverter pooled(dh);
+    if (!conv->valid()) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, (std::string("Unknown encoding or conversion not supported: ") + inenc).c_str(), ERL_NIF_LATIN1));
+    }
+
+    // Mapped characters are replaced while decoding, so they must map to code points.
+    std::string error;
+    for (size_t i = 0; i < decopt.map.size(); ++i) {
+        if (decopt.map[i].raw) {
+            error = "Bytes can't be mapped to when converting to several encodings.";
+        }
+    }
+    if (!error.empty() || !setup_handle(dh, error)) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, error.c_str(), ERL_NIF_LATIN1));
+    }
+
+    // ...and each block of it encoded to all destinations.
+    ConvertOptions encopt(opt);
+    encopt.transfer = TransferDecoder::TRANSFER_NONE;
+    encopt.map.clear();
+    encopt.inflate = Inflater::FORMAT_NONE;
+    MultiTargets multi;
+    multi.targets.resize(count);
+    ERL_NIF_TERM lst = argv[2];
+    ERL_NIF_TERM head;
+    for (unsigned i = 0; enif_get_list_cell(env, lst, &head, &lst); ++i) {
+        char outenc[64];
+        MultiTarget& t = multi.targets[i];
+        if (enif_get_string(env, head, outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0) {
+            return enif_make_badarg(env);
+        }
+        const char* target = converter_target(outenc, opt.output);
+        EncodingConverter* enc = target ? pool_acquire("UCS-4BE", target, encopt.converterOption()) : 0;
+        if (!target) {
+            t.error = enif_make_tuple2(
+                env,
+                enif_make_atom(env, "error"),
+                enif_make_string(env, (std::string("Code points need a Unicode destination encoding: ") + outenc).c_str(), ERL_NIF_LATIN1));
+            continue;
+        }
+        if (!enc || !enc->valid()) {
+            pool_release(enc, encopt.converterOption());
+            t.error = enif_make_tuple2(
+                env,
+                enif_make_atom(env, "error"),
+                enif_make_string(env,
+                    (std::string("Unknown encoding or conversion not supported: ") + inenc + " or " + outenc).c_str(), ERL_NIF_LATIN1));
+            continue;
+        }
+        t.h = new ConverterHandle(enc, encopt);
+        t.out = new ConvertOutput(output_chunk_size(opt.output), in.size);
+    }
+
+    ConvertOutput ucs(0, MULTI_BLOCK * 4);
+    std::vector<SourceMark> marks;
+    dh.marks = &marks;
+    dh.outputCap = MULTI_BLOCK * 4;
+    const char* src = reinterpret_cast<const char*>(in.data);
+    size_t rest = in.size;
+    bool raw = !dh.buffered();
+    bool flushed = false;
+    EncodingConverter::RESULT result = EncodingConverter::RESULT_OK;
+    while (!flushed) {
+        ucs.rewind();
+        marks.clear();
+        marks.push_back(SourceMark(0, dh.position, true));
+        if (rest > 0 || !dh.pending.empty()) {
+            size_t block = (rest < MULTI_BLOCK) ? rest : MULTI_BLOCK;
+            size_t left = block;
+            size_t pending = dh.pending.size();
+            convert_handle(dh, src, left, ucs);
+            if (raw) {
+                src += block - left;
+                rest -= block - left;
+                // Go on with the next block unless the decoder got stuck.
+                if (left > 0 && (left == block || left == rest ||
+                    dh.reader()->lastResult() != EncodingConverter::RESULT_INCOMPLETE_INPUT))
+                {
+                    flushed = true;
+                }
+            } else {
+                src += block;
+                rest -= block;
+                // Compressed input held back by outputCap comes in the next blocks.
+                if (conversion_stuck(dh) || (dh.inflater && dh.inflater->failed()) ||
+                    (block == 0 && ucs.written() == 0 && dh.pending.size() >= pending))
+                {
+                    flushed = true;
+                }
+            }
+        } else {
+            flushed = true;
+        }
+        if (flushed) {
+            result = dh.reader()->lastResult();
+            flush_into(dh.conv, ucs);
+        }
+        if (ucs.failed()) {
+            return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
+        }
+
+        for (size_t i = 0; i < multi.targets.size(); ++i) {
+            MultiTarget& t = multi.targets[i];
+            if (!t.h || t.stopped || ucs.size() == 0) {
+                continue;
+            }
+            size_t len = ucs.size();
+            convert_handle(*t.h, ucs.data(), len, *t.out);
+            t.stopped = (len > 0);
+            if (t.stopped) {
+                t.offset = multi_stop_offset(inenc, opt, in, marks, ucs.size() - len);
+            }
+        }
+    }
+    size_t unconverted = raw ? rest : dh.carry.size();
+    const char* decodeError = input_error(dh, result, unconverted);
+
+    std::vector<ERL_NIF_TERM> results(multi.targets.size());
+    for (size_t i = 0; i < multi.targets.size(); ++i) {
+        MultiTarget& t = multi.targets[i];
+        if (!t.h) {
+            results[i] = t.error;
+            continue;
+        }
+
+        const char* reason = decodeError;
+        if (t.stopped) {
+            reason = (t.h->conv->lastResult() == EncodingConverter::RESULT_INCOMPLETE_INPUT) ? "incomplete" : "invalid_sequence";
+        }
+        flush_into(t.h->conv, *t.out);
+        ERL_NIF_TERM term = 0;
+        if (!output_to_term(env, *t.out, opt.output, term)) {
+            results[i] = enif_make_tuple2(env, enif_make_atom(env, "error"),
+                enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
+        } else if (reason) {
+            size_t offset = t.stopped ? t.offset : dh.position;
+            results[i] = enif_make_tuple3(
+                env,
+                enif_make_atom(env, "error"),
+                enif_make_tuple2(env, enif_make_atom(env, reason), enif_make_uint64(env, offset)),
+                term);
+        } else {
+            results[i] = enif_make_tuple3(env, enif_make_atom(env, "ok"), term, enif_make_uint64(env, unconverted));
+        }
+    }
+
+    return enif_make_list_from_array(env, results.empty() ? 0 : &results[0], (unsigned)results.size());
+}
+
+// Encoding to convert the pattern of find() to. Byte order marks are left out:
+// UTF-16 and UTF-32 without an explicit byte order follow the one of the haystack.
+static std::string search_pattern_encoding(const char* enc, CharBoundary::SCHEME scheme, const ErlNifBinary& haystack)
+{
+    std::string name;
+    for (const char* p = enc; *p && *p != '/'; ++p) {
+        if (*p != '-' && *p != '_') {
+            name += (char)toupper((unsigned char)*p);
+        }
+    }
+
+    const unsigned char* h = haystack.data;
+    if (scheme == CharBoundary::SCHEME_UTF16 && (name == "UTF16" || name == "UCS2")) {
+        bool le = (haystack.size >= 2 && h[0] == 0xFF && h[1] == 0xFE);
+        return le ? "UTF-16LE" : "UTF-16BE";
+    }
+    if (scheme == CharBoundary::SCHEME_UTF32 && (name == "UTF32" || name == "UCS4")) {
+        bool le = (haystack.size >= 4 && h[0] == 0xFF && h[1] == 0xFE && h[2] == 0 && h[3] == 0);
+        return le ? "UTF-32LE" : "UTF-32BE";
+    }
+    return enc;
+}
+
+static ERL_NIF_TERM find_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary haystack;
+    ErlNifBinary pattern;
+    char enc[64];
+    char patenc[64];
+
+    if (!enif_inspect_binary(env, argv[0], &haystack) ||
+        enif_get_string(env, argv[1], enc, sizeof(enc), ERL_NIF_LATIN1) <= 0 ||
+        !enif_inspect_iolist_as_binary(env, argv[2], &pattern) ||
+        enif_get_string(env, argv[3], patenc, sizeof(patenc), ERL_NIF_LATIN1) <= 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+    CharBoundary::SCHEME scheme = search_scheme(enc);
+    if (scheme == CharBoundary::SCHEME_UNKNOWN || scheme == CharBoundary::SCHEME_STATEFUL) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, (std::string("Can't search in encoding: ") + enc).c_str(), ERL_NIF_LATIN1));
+    }
+
+    // The pattern is converted once; the haystack is searched as it is.
+    std::string target = search_pattern_encoding(enc, scheme, haystack);
+    EncodingConverter* conv = pool_acquire(patenc, target.c_str(), EncodingConverter::CONVERT_NONE);
+    std::string pat;
+    size_t left = pattern.size;
+    bool converted = false;
+    if (conv && conv->valid()) {
+        pat = conv->convert(pattern.data, left);
+        pat += conv->flush();
+        converted = (left == 0);
+    }
+    pool_release(conv, EncodingConverter::CONVERT_NONE);
+    if (!converted) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env,
+                (std::string("Can't convert the pattern from ") + patenc + " to " + enc).c_str(), ERL_NIF_LATIN1));
+    }
+
+    // memchr() for the first byte (which C libraries vectorize), then compare the rest.
+    // Matches beginning in the middle of a character are dropped; matches don't overlap.
+    std::vector<ERL_NIF_TERM> offsets;
+    if (!pat.empty() && pat.size() <= haystack.size) {
+        const unsigned char* h = haystack.data;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(pat.data());
+        size_t m = pat.size();
+        size_t last = haystack.size - m;
+        CharBoundary boundary(scheme, h, haystack.size);
+        size_t pos = 0;
+        while (pos <= last) {
+            const void* hit = memchr(h + pos, p[0], last - pos + 1);
+            if (!hit) {
+                break;
+            }
+            pos = static_cast<const unsigned char*>(hit) - h;
+            if (memcmp(h + pos + 1, p + 1, m - 1) == 0 && boundary.at(pos)) {
+                offsets.push_back(enif_make_uint64(env, pos));
+                pos += m;
+            } else {
+                ++pos;
+            }
+        }
+    }
+
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"),
+        enif_make_list_from_array(env, offsets.empty() ? 0 : &offsets[0], (unsigned)offsets.size()));
+}
+
+// Charset assumed for the header text outside encoded-words, unless the caller tells otherwise.
+static const char* const MIME_LITERAL_CHARSET = "ISO-8859-1";
+
+// Flushes the current run into out and gives its converter back to the pool.
+static void mime_end_run(ConverterHandle*& h, ConvertOutput& out)
+{
+    if (h) {
+        flush_into(h->conv, out);
+        pool_release(h->conv, EncodingConverter::CONVERT_DISCARD_ILSEQ);
+        h->conv = 0;
+        delete h;
+        h = 0;
     }
 }
-#else
-#define create_converter_noabort(INENC, OUTENC, OPT) new EncodingConverter(INENC, OUTENC, OPT)
-#endif
 
-inline static bool binary_to_string(ErlNifEnv* env, ERL_NIF_TERM term, std::string& out)
+// Makes h ready to convert text in charset, flushing the previous run into out if the charset changes.
+// Consecutive runs in the same charset share the handle so a character split across encoded-words survives.
+static bool mime_begin_run(
+    ConverterHandle*& h, std::string& curenc, const std::string& charset,
+    TransferDecoder::ENCODING transfer, const char* outenc, ConvertOutput& out)
 {
-    ErlNifBinary bin;
+    if (!h || curenc != charset) {
+        mime_end_run(h, out);
 
-    memset(&bin, 0, sizeof(bin));
-    if (!enif_inspect_binary(env, term, &bin)) {
-        return false;
+        EncodingConverter* conv = pool_acquire(
+            charset.c_str(), outenc, EncodingConverter::CONVERT_DISCARD_ILSEQ);
+        if (!conv || !conv->valid()) {
+            delete conv;
+            return false;
+        }
+        h = new ConverterHandle(conv, ConvertOptions(EncodingConverter::CONVERT_DISCARD_ILSEQ));
+        curenc = charset;
     }
+    h->decoder.setEncoding(transfer);
 
-    out.assign(reinterpret_cast<const char*>(bin.data), bin.size);
     return true;
 }
 
-inline static bool string_to_binary(ErlNifEnv* env, const std::string& in, ERL_NIF_TERM& term)
+// Returns true if text in charset can be converted to outenc.
+static bool mime_charset_known(const std::string& charset, const char* outenc)
 {
-    ErlNifBinary bin;
+    EncodingConverter* conv = pool_acquire(charset.c_str(), outenc, EncodingConverter::CONVERT_DISCARD_ILSEQ);
+    bool known = (conv && conv->valid());
+    pool_release(conv, EncodingConverter::CONVERT_DISCARD_ILSEQ);
 
-    memset(&bin, 0, sizeof(bin));
-    size_t len = in.length();
-    if (!enif_alloc_binary(len, &bin)) {
+    return known;
+}
+
+// Parses an RFC 2047 encoded-word "=?charset?B|Q?text?=" at pos.
+// On success, returns true and sets charset, transfer, the text range and end (just past "?=").
+static bool mime_parse_word(
+    const std::string& in, size_t pos, std::string& charset, TransferDecoder::ENCODING& transfer,
+    size_t& textpos, size_t& textlen, size_t& end)
+{
+    if (in.compare(pos, 2, "=?") != 0) {
         return false;
     }
 
-    if (len > 0) {
-        memcpy(bin.data, &in[0], len);
+    size_t q1 = in.find('?', pos + 2);
+    if (q1 == std::string::npos || q1 == pos + 2 || q1 + 2 >= in.length() || in[q1 + 2] != '?') {
+        return false;
+    }
+    for (size_t i = pos + 2; i < q1; ++i) {
+        if (isspace((unsigned char)in[i]) || iscntrl((unsigned char)in[i])) {
+            return false;
+        }
     }
 
-    term = enif_make_binary(env, &bin);
+    switch (in[q1 + 1]) {
+    case 'B': case 'b':
+        transfer = TransferDecoder::TRANSFER_BASE64;
+        break;
+    case 'Q': case 'q':
+        transfer = TransferDecoder::TRANSFER_Q;
+        break;
+    default:
+        return false;
+    }
+
+    textpos = q1 + 3;
+    size_t q2 = in.find("?=", textpos);
+    if (q2 == std::string::npos) {
+        return false;
+    }
+    for (size_t i = textpos; i < q2; ++i) {
+        if (isspace((unsigned char)in[i])) {
+            return false;
+        }
+    }
+
+    // RFC 2231 allows a language tag: "charset*lang".
+    charset.assign(in, pos + 2, q1 - (pos + 2));
+    charset = charset.substr(0, charset.find('*'));
+    textlen = q2 - textpos;
+    end = q2 + 2;
 
     return true;
 }
 
-inline static bool parse_option_list(ErlNifEnv* env, ERL_NIF_TERM lst, EncodingConverter::OPTION& opt)
+static ERL_NIF_TERM decode_mime_header_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    char optstr[32];
-    ERL_NIF_TERM head;
+    std::string in;
+    ConvertOutput out;
+    char outenc[64];
+    char litenc[64];
 
-    if (!enif_is_list(env, lst)) {
-        return false;
+    strcpy(litenc, MIME_LITERAL_CHARSET);
+    if (!binary_to_string(env, argv[0], in) ||
+        enif_get_string(env, argv[1], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0 ||
+        (argc > 2 && enif_get_string(env, argv[2], litenc, sizeof(litenc), ERL_NIF_LATIN1) <= 0))
+    {
+        return enif_make_badarg(env);
     }
 
-    opt = EncodingConverter::CONVERT_NONE;
+    ConverterHandle* h = 0;
+    std::string curenc;
+    std::string badenc;
+    bool prevword = false;
+    size_t pos = 0;
 
-    while (enif_get_list_cell(env, lst, &head, &lst)) {
-        if (enif_get_atom(env, head, optstr, sizeof(optstr), ERL_NIF_LATIN1) <= 0) {
-            return false;
+    while (pos < in.length()) {
+        std::string charset;
+        TransferDecoder::ENCODING transfer = TransferDecoder::TRANSFER_NONE;
+        size_t textpos = 0, textlen = 0, end = 0;
+
+        // Find the next encoded-word.
+        size_t wordpos = in.find("=?", pos);
+        while (wordpos != std::string::npos &&
+            !mime_parse_word(in, wordpos, charset, transfer, textpos, textlen, end))
+        {
+            wordpos = in.find("=?", wordpos + 1);
         }
-        if (strcmp("translit", optstr) == 0) {
-            opt = (EncodingConverter::OPTION)(opt | EncodingConverter::CONVERT_TRANSLITERATE);
-        } else if (strcmp("ignore", optstr) == 0) {
-            opt = (EncodingConverter::OPTION)(opt | EncodingConverter::CONVERT_DISCARD_ILSEQ);
-        } else {
-            return false;
+        if (wordpos == std::string::npos) {
+            wordpos = in.length();
         }
-    }
 
-    return true;
-}
+        // Words in a charset we don't know are left as they are (RFC 2047 6.2).
+        bool decodable = (wordpos < in.length() && mime_charset_known(charset, outenc));
 
-inline static ERL_NIF_TERM convert_internal(
-    ErlNifEnv* env,
-    const std::string& in, std::string& out,
-    const char* inenc, const char* outenc, EncodingConverter::OPTION opt)
-{
-    EncodingConverter* conv = 0;
-	ERL_NIF_TERM ret = 0;
+        // Text before it, unfolded. Whitespace between two encoded-words is dropped.
+        std::string literal;
+        bool blank = true;
+        for (size_t i = pos; i < wordpos; ++i) {
+            char c = in[i];
+            if ((c == '\r' || c == '\n') && (i + 1 >= wordpos || isspace((unsigned char)in[i + 1]))) {
+                continue;
+            }
+            if (c != ' ' && c != '\t') {
+                blank = false;
+            }
+            literal += c;
+        }
+        if (!decodable && wordpos < in.length()) {
+            literal.append(in, wordpos, end - wordpos);
+            blank = false;
+        }
+        if (!literal.empty() && !(blank && prevword && decodable)) {
+            if (!mime_begin_run(h, curenc, litenc, TransferDecoder::TRANSFER_NONE, outenc, out)) {
+                badenc = litenc;
+                break;
+            }
+            size_t len = literal.length();
+            convert_handle(*h, literal.c_str(), len, out);
+        }
+        if (wordpos == in.length()) {
+            break;
+        }
 
-	do {
-		conv = create_converter_noabort(inenc, outenc, opt);
-		if (!conv) {
-			// Failed to create a converter. Probably initialize() has not been called yet.
-			ret = enif_make_tuple2(
-				env,
-				enif_make_atom(env, "error"),
-				enif_make_string(env, "Can't create a converter. Probably you haven't called initialize() yet.", ERL_NIF_LATIN1));
-			break;
-		}
-		if (!conv->valid()) {
-			// The converter is not valid. Any of the specified encodings may be wrong/unsupported.
-			ret = enif_make_tuple2(
-				env,
-				enif_make_atom(env, "error"),
-				enif_make_string(env,
-					(std::string("Unknown encoding or conversion not supported: ") + inenc + " or " + outenc).c_str(), ERL_NIF_LATIN1));
-			break;
-		}
+        // The encoded-word itself.
+        if (decodable) {
+            if (!mime_begin_run(h, curenc, charset, transfer, outenc, out)) {
+                badenc = charset;
+                break;
+            }
+            size_t len = textlen;
+            convert_handle(*h, in.c_str() + textpos, len, out);
+        }
 
-		// Do conversion
-		size_t inlen = in.length();
-		out.assign(conv->convert(in.c_str(), inlen));
-		out += conv->flush();
-
-		if (inlen > 0 &&
-			(opt & EncodingConverter::CONVERT_DISCARD_ILSEQ) == 0)
-		{
-			// The input was not fully consumed.
-			ret = enif_make_tuple2(
-				env,
-				enif_make_atom(env, "error"),
-				enif_make_string(env, "Incomplete/invalid input.", ERL_NIF_LATIN1));
-			break;
-		}
+        prevword = decodable;
+        pos = end;
+    }
 
-		if (string_to_binary(env, out, ret)) {
-			// Success
-			ret = enif_make_tuple3(env, enif_make_atom(env, "ok"), ret, enif_make_uint64(env, inlen));
-		} else {
-			// Running out of memory?
-			ret = enif_make_tuple2(env, enif_make_atom(env, "error"),
-				enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
-		}
-	} while (false);
+    mime_end_run(h, out);
 
-	if (conv) delete conv;
-	return ret;
+    ERL_NIF_TERM ret = 0;
+    if (!badenc.empty()) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env,
+                (std::string("Unknown encoding or conversion not supported: ") + badenc + " or " + outenc).c_str(), ERL_NIF_LATIN1));
+    }
+    if (out.makeTerm(env, ret)) {
+        return enif_make_tuple2(env, enif_make_atom(env, "ok"), ret);
+    } else {
+        return enif_make_tuple2(env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
+    }
 }
 
-static ERL_NIF_TERM convert_binary_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// What a converter term refers to. A new library takes over the converters of the old one
+// on upgrade (see load_pool()), so the layout must stay the same across versions.
+struct ConverterRef
 {
-    std::string in;
-    std::string out;
-    char inenc[64];
-    char outenc[64];
+    ErlNifUInt64 library;       // ConverterPool::id of the library which created handle.
+    ConverterHandle* handle;    // Null once destroyed.
+};
 
-    if (!binary_to_string(env, argv[0], in) ||
-        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
-        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0) {
-            return enif_make_badarg(env);
+static ErlNifResourceType* converter_type = 0;
+
+// Unlinks the handle from ref. Returns it to be deleted, or null if it was gone already.
+static ConverterHandle* detach_handle(ConverterRef* ref)
+{
+    enif_mutex_lock(pool->lock);
+    ConverterHandle* h = ref->handle;
+    ref->handle = 0;
+    if (h) {
+        pool->handles.erase(h);
     }
+    enif_mutex_unlock(pool->lock);
 
-    return convert_internal(env, in, out, inenc, outenc, EncodingConverter::CONVERT_DISCARD_ILSEQ);
+    if (h) {
+        ENCCONV_PROBE1(converter_destroy, h);
+    }
+    return h;
 }
 
-static ERL_NIF_TERM convert_binary_opt_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Destructor of converter_type, run once no term refers to the converter. A converter of
+// another library is left to that library, which frees it in unload(): it may be laid out
+// differently, and its code is the other library's.
+static void converter_dtor(ErlNifEnv* env, void* obj)
 {
-    std::string in;
-    std::string out;
-    char inenc[64];
-    char outenc[64];
-    EncodingConverter::OPTION opt;
+    ConverterRef* ref = static_cast<ConverterRef*>(obj);
 
-    if (!binary_to_string(env, argv[0], in) ||
-        enif_get_string(env, argv[1], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
-        enif_get_string(env, argv[2], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0)
-    {
-        return enif_make_badarg(env);
+    if (pool && ref->library == pool->id) {
+        delete detach_handle(ref);
     }
+}
 
-    if (!parse_option_list(env, argv[3], opt)) {
-        return enif_make_tuple2(
-            env,
-            enif_make_atom(env, "error"),
-            enif_make_string(env, "Unknown option.", ERL_NIF_LATIN1));
-    }
+// Returns the converter term stands for, of this library or not, or null if it is not one.
+static ConverterRef* get_ref(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    void* obj = 0;
 
-    return convert_internal(env, in, out, inenc, outenc, opt);
+    return enif_get_resource(env, term, converter_type, &obj) ? static_cast<ConverterRef*>(obj) : 0;
+}
+
+// Returns the handle term stands for, or null if it is not a live converter of this library.
+// Converters created by another version of the library (before an upgrade) are refused:
+// their code may be gone already.
+static ConverterHandle* get_handle(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    ConverterRef* ref = get_ref(env, term);
+
+    return (ref && ref->library == pool->id) ? ref->handle : 0;
 }
 
 static ERL_NIF_TERM create_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     char inenc[64];
     char outenc[64];
-    EncodingConverter::OPTION opt;
+    ConvertOptions opt;
 
     if (enif_get_string(env, argv[0], inenc, sizeof(inenc), ERL_NIF_LATIN1) <= 0 ||
         enif_get_string(env, argv[1], outenc, sizeof(outenc), ERL_NIF_LATIN1) <= 0)
@@ -210,7 +3132,15 @@ static ERL_NIF_TERM create_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF
             enif_make_string(env, "Unknown option.", ERL_NIF_LATIN1));
     }
 
-    EncodingConverter* conv = create_converter_noabort(inenc, outenc, opt);
+    const char* target = converter_target(outenc, opt.output);
+    if (!target) {
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, (std::string("Code points need a Unicode destination encoding: ") + outenc).c_str(), ERL_NIF_LATIN1));
+    }
+
+    EncodingConverter* conv = open_converter(inenc, target, opt.converterOption());
 
     if (!conv) {
         return enif_make_tuple2(
@@ -227,63 +3157,114 @@ static ERL_NIF_TERM create_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF
                 (std::string("Unknown encoding or conversion not supported: ") + inenc + " or " + outenc).c_str(), ERL_NIF_LATIN1));
     }
 
-    return enif_make_tuple2(
-        env, enif_make_atom(env, "ok"), enif_make_uint64(env, reinterpret_cast<ErlNifUInt64>(conv)));
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+    ConverterHandle* h = new ConverterHandle(conv, opt);
+    std::string error;
+    if (!setup_handle(*h, error)) {
+        delete h;
+        return enif_make_tuple2(
+            env,
+            enif_make_atom(env, "error"),
+            enif_make_string(env, error.c_str(), ERL_NIF_LATIN1));
+    }
+    h->inenc = inenc;
+    h->outenc = outenc;
+    if (st) {
+        st->latency.resolve(h->latency, inenc, outenc);
+    }
+    ENCCONV_PROBE3(converter_create, h, inenc, outenc);
+
+    enif_mutex_lock(pool->lock);
+    pool->handles.insert(h);
+    enif_mutex_unlock(pool->lock);
+    ConverterRef* ref = static_cast<ConverterRef*>(enif_alloc_resource(converter_type, sizeof(ConverterRef)));
+    ref->library = pool->id;
+    ref->handle = h;
+    ERL_NIF_TERM term = enif_make_resource(env, ref);
+    enif_release_resource(ref);
+
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
 }
 
 static ERL_NIF_TERM destroy_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifUInt64 opaq = 0;
-    EncodingConverter* conv = 0;
+    ConverterRef* ref = get_ref(env, argv[0]);
 
-    if (!enif_get_uint64(env, argv[0], &opaq) || !opaq) {
+    if (!ref) {
         return enif_make_badarg(env);
     }
 
-    conv = reinterpret_cast<EncodingConverter*>(opaq);
-    delete conv;
+    // A converter of another library is freed when that library is unloaded.
+    if (ref->library == pool->id) {
+        delete detach_handle(ref);
+    }
 
     return enif_make_atom(env, "ok");
 }
 
 static ERL_NIF_TERM do_convert_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    std::string in;
-    ErlNifUInt64 opaq = 0;
-    EncodingConverter* conv = 0;
+    ErlNifBinary in;
+    ConverterHandle* h = 0;
 
-    if (!binary_to_string(env, argv[0], in) ||
-        !enif_get_uint64(env, argv[1], &opaq) || !opaq) {
+    if (!enif_inspect_binary(env, argv[0], &in) ||
+        !(h = get_handle(env, argv[1]))) {
             return enif_make_badarg(env);
     }
-    conv = reinterpret_cast<EncodingConverter*>(opaq);
 
-    size_t inlen = in.length();
-    std::string out = conv->convert(in.c_str(), inlen);
+    ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+    const char* inenc = h->inenc.c_str();
+    const char* outenc = h->outenc.c_str();
+    ENCCONV_PROBE3(convert_start, inenc, outenc, in.size);
+
+    size_t inlen = in.size;
+    ConvertOutput out(output_chunk_size(h->opt.output), in.size);
+    convert_handle(*h, reinterpret_cast<const char*>(in.data), inlen, out);
 
     ERL_NIF_TERM ret = 0;
-    if (string_to_binary(env, out, ret)) {
-        return enif_make_tuple3(env, enif_make_atom(env, "ok"), ret, enif_make_uint64(env, inlen));
-    } else {
-        return enif_make_tuple2(
+    if (!output_to_term(env, out, h->opt.output, ret)) {
+        ENCCONV_PROBE4(convert_error, inenc, outenc, "no_memory", h->position);
+        ret = enif_make_tuple2(
             env, enif_make_atom(env, "error"),
             enif_make_string(env, "Unable to make binary.", ERL_NIF_LATIN1));
+    } else if (h->buffered() && (conversion_stuck(*h) || (h->inflater && h->inflater->failed()))) {
+        // The converter holds the input, so the caller can't pass the bad bytes again;
+        // nothing more is taken until the converter is reset.
+        const char* reason = input_error(*h, h->reader()->lastResult(), h->carry.size());
+        if (!reason) {
+            reason = "invalid_sequence";
+        }
+        ENCCONV_PROBE4(convert_error, inenc, outenc, reason, h->position);
+        ret = enif_make_tuple3(
+            env, enif_make_atom(env, "error"),
+            enif_make_tuple2(env, enif_make_atom(env, reason), enif_make_uint64(env, h->position)),
+            ret);
+    } else {
+        ret = enif_make_tuple3(env, enif_make_atom(env, "ok"), ret, enif_make_uint64(env, inlen));
+    }
+
+    ErlNifTime elapsed = enif_monotonic_time(ERL_NIF_NSEC) - start;
+    ENCCONV_PROBE5(convert_end, inenc, outenc, in.size, out.written(), elapsed);
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+    if (st) {
+        st->latency.resolve(h->latency, inenc, outenc);
+        st->latency.record(h->latency, elapsed);
     }
+    return ret;
 }
 
 static ERL_NIF_TERM flush_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifUInt64 opaq = 0;
-    EncodingConverter* conv = 0;
+    ConverterHandle* h = get_handle(env, argv[0]);
 
-    if (!enif_get_uint64(env, argv[0], &opaq) || !opaq) {
+    if (!h) {
         return enif_make_badarg(env);
     }
-    conv = reinterpret_cast<EncodingConverter*>(opaq);
 
-    std::string out = conv->flush();
+    ConvertOutput out(output_chunk_size(h->opt.output));
+    flush_into(h->conv, out);
     ERL_NIF_TERM ret = 0;
-    if (string_to_binary(env, out, ret)) {
+    if (output_to_term(env, out, h->opt.output, ret)) {
         return enif_make_tuple2(env, enif_make_atom(env, "ok"), ret);
     } else {
         return enif_make_tuple2(env,
@@ -294,15 +3275,13 @@ static ERL_NIF_TERM flush_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF_
 
 static ERL_NIF_TERM reset_converter_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifUInt64 opaq = 0;
-    EncodingConverter* conv = 0;
+    ConverterHandle* h = get_handle(env, argv[0]);
 
-    if (!enif_get_uint64(env, argv[0], &opaq) || !opaq) {
+    if (!h) {
         return enif_make_badarg(env);
     }
-    conv = reinterpret_cast<EncodingConverter*>(opaq);
 
-    conv->reset();
+    h->reset();
 
     return enif_make_atom(env, "ok");
 }
@@ -323,11 +3302,183 @@ static ERL_NIF_TERM uninitialize_nif(ErlNifEnv* env, int argc, const ERL_NIF_TER
     return enif_make_atom(env, "ok");
 }
 
+static ERL_NIF_TERM cache_clear_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+
+    st->cache.clear();
+
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM cache_info_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+
+    return st->cache.info(env);
+}
+
+static ERL_NIF_TERM latency_histograms_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+
+    return st->latency.info(env);
+}
+
+static ERL_NIF_TERM latency_clear_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+
+    st->latency.clear();
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM cache_configure_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    NifState* st = static_cast<NifState*>(enif_priv_data(env));
+    ERL_NIF_TERM lst = argv[0];
+    ERL_NIF_TERM head;
+    const ERL_NIF_TERM* tuple;
+    int arity;
+    char name[16];
+    size_t maxInput, maxMemory;
+
+    st->cache.limits(maxInput, maxMemory);
+    if (!enif_is_list(env, lst)) {
+        return enif_make_badarg(env);
+    }
+    while (enif_get_list_cell(env, lst, &head, &lst)) {
+        ErlNifUInt64 value;
+        if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2 ||
+            enif_get_atom(env, tuple[0], name, sizeof(name), ERL_NIF_LATIN1) <= 0 ||
+            !enif_get_uint64(env, tuple[1], &value))
+        {
+            return enif_make_badarg(env);
+        }
+        if (strcmp("max_input", name) == 0) {
+            maxInput = (size_t)value;
+        } else if (strcmp("max_memory", name) == 0) {
+            maxMemory = (size_t)value;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+    st->cache.configure(maxInput, maxMemory);
+
+    return enif_make_atom(env, "ok");
+}
+
+static ERL_NIF_TERM preopen_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (!pool_preopen(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+
+    return enif_make_atom(env, "ok");
+}
+
+// Sets up the pool of this library, shared with any earlier load of the same library, and
+// the resource type of the converters, taken over from the old library on upgrade (flags).
+// load_info is a list of pairs to open in advance (see pool_preopen()), or anything else for none.
+static bool load_pool(ErlNifEnv* env, ERL_NIF_TERM load_info, ErlNifResourceFlags flags)
+{
+    converter_type = enif_open_resource_type(env, NULL, "encconv_converter", converter_dtor, flags, NULL);
+    if (!converter_type) {
+        return false;
+    }
+    if (pool) {
+        ++pool->refs;
+    } else {
+        pool = new ConverterPool();
+    }
+
+    if (enif_is_list(env, load_info) && !pool_preopen(env, load_info)) {
+        if (--pool->refs == 0) {
+            delete pool;
+            pool = 0;
+        }
+        return false;
+    }
+    return true;
+}
+
+static int load_library(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info, ErlNifResourceFlags flags)
+{
+    if (!load_pool(env, load_info, flags)) {
+        return 1;
+    }
+
+    *priv_data = new NifState();
+    return 0;
+}
+
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
+{
+    return load_library(env, priv_data, load_info, ERL_NIF_RT_CREATE);
+}
+
+static int upgrade(ErlNifEnv* env, void** priv_data, void** old_priv_data, ERL_NIF_TERM load_info)
+{
+    NifState* st = static_cast<NifState*>(*old_priv_data);
+
+    if (!(st && st->version == NIF_STATE_VERSION && st->size == sizeof(NifState))) {
+        return load_library(env, priv_data, load_info, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER));
+    }
+
+    // Keep the cache and the statistics of the old library. Its converters stay with it
+    // until it is unloaded.
+    if (!load_pool(env, load_info, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER))) {
+        return 1;
+    }
+    enif_mutex_lock(st->lock);
+    ++st->refs;
+    enif_mutex_unlock(st->lock);
+    *priv_data = st;
+    return 0;
+}
+
+static void unload(ErlNifEnv* env, void* priv_data)
+{
+    NifState* st = static_cast<NifState*>(priv_data);
+
+    enif_mutex_lock(st->lock);
+    int refs = --st->refs;
+    enif_mutex_unlock(st->lock);
+
+    if (refs == 0) {
+        delete st;
+    }
+    if (--pool->refs == 0) {
+        // Converters still referred to from Erlang can't be used any more: their code goes
+        // with this library. The terms are refused by get_handle() of the next one.
+        std::set<ConverterHandle*> handles;
+        handles.swap(pool->handles);
+        std::set<ConverterHandle*>::iterator it;
+        for (it = handles.begin(); it != handles.end(); ++it) {
+            delete *it;
+        }
+        delete pool;
+        pool = 0;
+    }
+}
+
 static ErlNifFunc nif_funcs[] = {
     {"initialize", 0, initialize_nif},
     {"uninitialize", 0, uninitialize_nif},
+    {"preopen", 1, preopen_nif},
+    {"cache_configure", 1, cache_configure_nif},
+    {"cache_info", 0, cache_info_nif},
+    {"cache_clear", 0, cache_clear_nif},
+    {"latency_histograms", 0, latency_histograms_nif},
+    {"latency_clear", 0, latency_clear_nif},
     {"convert_binary", 3, convert_binary_nif},
     {"convert_binary", 4, convert_binary_opt_nif},
+    {"convert_list", 3, convert_list_nif},
+    {"convert_list", 4, convert_list_opt_nif},
+    {"convert_multi", 4, convert_multi_nif},
+    {"find", 4, find_nif},
+    {"decode_mime_header", 2, decode_mime_header_nif},
+    {"decode_mime_header", 3, decode_mime_header_nif},
     {"create_converter", 3, create_converter_nif},
     {"destroy_converter", 1, destroy_converter_nif},
     {"do_convert", 2, do_convert_nif},
@@ -335,4 +3486,4 @@ static ErlNifFunc nif_funcs[] = {
     {"reset_converter", 1, reset_converter_nif}
 };
 
-ERL_NIF_INIT(encconv, nif_funcs, NULL, NULL, NULL, NULL)
+ERL_NIF_INIT(encconv, nif_funcs, load, NULL, upgrade, unload)
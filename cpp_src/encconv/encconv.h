@@ -19,11 +19,13 @@
 #   include <mlang.h>
 #else
 #   include <iconv.h>
+#   include "sbcs.h"
 #endif
 
 #include <string>
 #include <cstring>
 #include <cctype>
+#include <cerrno>
 
 
 namespace portpp {
@@ -39,10 +41,19 @@ namespace portpp {
 			CONVERT_DISCARD_ILSEQ	= 2, // Discard invalid byte sequences.
 		};
 
+		enum RESULT
+		{
+			RESULT_OK					= 0, // The last call succeeded.
+			RESULT_OUTPUT_FULL			= 1, // The output buffer was too small.
+			RESULT_INVALID_SEQUENCE		= 2, // An invalid or unconvertible sequence was found in the input.
+			RESULT_INCOMPLETE_INPUT		= 3, // The input ended in the middle of a character.
+		};
+
 	protected:
 		std::string		fromEnc_;
 		std::string		toEnc_;
 		OPTION			opt_;
+		RESULT			result_;
 
 #if defined(_WIN32) && !defined(PORTPP_USE_LIBICONV)
 		DWORD					toCodePage_;
@@ -53,6 +64,34 @@ namespace portpp {
 		DWORD encNameToCodePage(const char* encName);
 #else
 		iconv_t					cd_;
+
+		// Table-driven conversion between a single-byte charset and UTF-8/UTF-16,
+		// or between two single-byte charsets. iconv is used only for what the tables can't do.
+		enum FAST_PATH
+		{
+			FAST_NONE,
+			FAST_DECODE,	// Single-byte charset -> Unicode.
+			FAST_ENCODE,	// Unicode -> single-byte charset.
+			FAST_RECODE,	// Single-byte charset -> single-byte charset.
+		};
+		enum UNICODE_FORM
+		{
+			FORM_NONE,
+			FORM_UTF8,
+			FORM_UTF16LE,
+			FORM_UTF16BE,
+		};
+		FAST_PATH				fast_;
+		UNICODE_FORM			form_;
+		const SingleByteTable*	fromTable_;	// Shared; see SingleByteTable::find().
+		const SingleByteTable*	toTable_;
+
+		bool setResult(size_t res);
+		static UNICODE_FORM unicodeForm(const char* encName);
+		static const SingleByteTable* singleByteTable(const char* encName);
+		void initFastPath();
+		bool convertFast(const unsigned char*& in, size_t& inleft, unsigned char*& out, size_t& outleft);
+		bool convertSlow(const unsigned char*& in, size_t& inleft, size_t len, unsigned char*& out, size_t& outleft);
 #endif
 
 	public:
@@ -82,6 +121,11 @@ namespace portpp {
 		*/
 		bool valid() const;
 		/**
+		* Returns why the last call to convert() or flush() stopped.
+		* @return RESULT_*.
+		*/
+		RESULT lastResult() const { return result_; }
+		/**
 		* Converts input and stores result into output.
 		* @param input [in] Input byte sequence.
 		* @param inputBytesLeft [in/out] Size of input in bytes.
@@ -118,14 +162,19 @@ namespace portpp {
 			std::string ret;
 			char buf[1024];
 			size_t buflen, prevlen;
+			const size_t inputBytesLeft0 = inputBytesLeft;
 
 			do {
 				prevlen = inputBytesLeft;
 				buflen = sizeof(buf);
-				if (!convert(input, inputBytesLeft, buf, buflen)) {
+				bool ok = convert(static_cast<const char*>(input) + (inputBytesLeft0 - inputBytesLeft),
+					inputBytesLeft, buf, buflen);
+				ret.append(buf, sizeof(buf)-buflen);
+				// A failure is fatal only when nothing was converted (e.g. an invalid sequence).
+				// Otherwise the output buffer was simply full.
+				if (!ok && prevlen == inputBytesLeft && buflen == sizeof(buf)) {
 					break;
 				}
-				ret.append(buf, sizeof(buf)-buflen);
 			} while (inputBytesLeft > 0);
 
 			return ret;
@@ -153,6 +202,7 @@ namespace portpp {
 		ml_ = 0;
 		conv_ = 0;
 		opt_ = opt;
+		result_ = RESULT_OK;
 
 		if (FAILED(CoCreateInstance(CLSID_CMultiLanguage, NULL,
 			CLSCTX_INPROC_SERVER, IID_IMultiLanguage2, (void**)&ml_)))
@@ -240,18 +290,23 @@ namespace portpp {
 			UINT dstsize = (outputBytesLeft > (size_t)UINT_MAX) ? UINT_MAX : (UINT)outputBytesLeft;
 
 			HRESULT hr = conv_->DoConversion(inbuf, &srcsize, outbuf, &dstsize);
-			if (FAILED(hr)) return false;
+			if (FAILED(hr)) {
+				result_ = RESULT_INVALID_SEQUENCE;
+				return false;
+			}
 
 			inputBytesLeft -= srcsize;
 			outputBytesLeft -= dstsize;
 		}
 
+		result_ = RESULT_OK;
 		return true;
 	}
 
 	inline bool EncodingConverter::flush(void* output, size_t& outputBytesLeft)
 	{
 		reset();
+		result_ = RESULT_OK;
 		return true;
 	}
 
@@ -325,6 +380,12 @@ namespace portpp {
 	inline EncodingConverter::EncodingConverter(const char* fromEnc, const char* toEnc, OPTION opt)
 	{
 		cd_ = (iconv_t)(-1);
+		opt_ = opt;
+		result_ = RESULT_OK;
+		fast_ = FAST_NONE;
+		form_ = FORM_NONE;
+		fromTable_ = 0;
+		toTable_ = 0;
 
 		fromEnc_ = fromEnc;
 		toEnc_ = toEnc;
@@ -337,6 +398,9 @@ namespace portpp {
 			tocode += "//IGNORE";
 		}
 		cd_ = iconv_open(tocode.c_str(), fromEnc);
+		if (valid()) {
+			initFastPath();
+		}
 	}
 
 	inline EncodingConverter::~EncodingConverter()
@@ -355,19 +419,46 @@ namespace portpp {
 	inline bool EncodingConverter::convert(const void* input, size_t& inputBytesLeft,
 		void* output, size_t& outputBytesLeft)
 	{
+		if (fast_ != FAST_NONE) {
+			const unsigned char* in = static_cast<const unsigned char*>(input);
+			unsigned char* out = static_cast<unsigned char*>(output);
+			return convertFast(in, inputBytesLeft, out, outputBytesLeft);
+		}
+
 		char** inbuf = (char**)(&input);
 		char** outbuf = (char**)(&output);
 
 		size_t res = iconv(cd_, inbuf, &inputBytesLeft, outbuf, &outputBytesLeft);
 
-		return (res != (size_t)(-1));
+		return setResult(res);
 	}
 
 	inline bool EncodingConverter::flush(void* output, size_t& outputBytesLeft)
 	{
 		char** outbuf = (char**)(&output);
 		size_t res = iconv(cd_, NULL, NULL, outbuf, &outputBytesLeft);
-		return (res != (size_t)(-1));
+		return setResult(res);
+	}
+
+	inline bool EncodingConverter::setResult(size_t res)
+	{
+		if (res != (size_t)(-1)) {
+			result_ = RESULT_OK;
+			return true;
+		}
+
+		switch (errno) {
+		case E2BIG:
+			result_ = RESULT_OUTPUT_FULL;
+			break;
+		case EINVAL:
+			result_ = RESULT_INCOMPLETE_INPUT;
+			break;
+		default:
+			result_ = RESULT_INVALID_SEQUENCE;
+			break;
+		}
+		return false;
 	}
 
 	inline void EncodingConverter::reset()
@@ -375,6 +466,216 @@ namespace portpp {
 		iconv(cd_, NULL, NULL, NULL, NULL);
 	}
 
+	inline EncodingConverter::UNICODE_FORM EncodingConverter::unicodeForm(const char* encName)
+	{
+		std::string name;
+		for (const char* p = encName; *p; ++p) {
+			if (*p != '-' && *p != '_') {
+				name += (char)toupper((unsigned char)*p);
+			}
+		}
+
+		if (name == "UTF8") return FORM_UTF8;
+		if (name == "UTF16LE") return FORM_UTF16LE;
+		if (name == "UTF16BE") return FORM_UTF16BE;
+		return FORM_NONE;
+	}
+
+	inline const SingleByteTable* EncodingConverter::singleByteTable(const char* encName)
+	{
+		// Leave names with iconv suffixes such as //TRANSLIT alone.
+		if (strchr(encName, '/') || unicodeForm(encName) != FORM_NONE) {
+			return 0;
+		}
+
+		return SingleByteTable::find(encName);
+	}
+
+	inline void EncodingConverter::initFastPath()
+	{
+		UNICODE_FORM fromForm = unicodeForm(fromEnc_.c_str());
+		UNICODE_FORM toForm = unicodeForm(toEnc_.c_str());
+
+		if (fromForm != FORM_NONE && toForm != FORM_NONE) {
+			return;
+		}
+		if (fromForm == FORM_NONE) {
+			fromTable_ = singleByteTable(fromEnc_.c_str());
+			if (!fromTable_) {
+				return;
+			}
+		}
+		if (toForm == FORM_NONE) {
+			toTable_ = singleByteTable(toEnc_.c_str());
+			if (!toTable_) {
+				fromTable_ = 0;
+				return;
+			}
+		}
+
+		if (fromTable_ && toTable_) {
+			fast_ = FAST_RECODE;
+		} else if (fromTable_) {
+			fast_ = FAST_DECODE;
+			form_ = toForm;
+		} else {
+			fast_ = FAST_ENCODE;
+			form_ = fromForm;
+		}
+	}
+
+	inline bool EncodingConverter::convertSlow(const unsigned char*& in, size_t& inleft, size_t len,
+		unsigned char*& out, size_t& outleft)
+	{
+		// Let iconv deal with a single character, so //TRANSLIT, //IGNORE and errors work as usual.
+		char* inbuf = (char*)in;
+		char* outbuf = (char*)out;
+		size_t left = len;
+
+		size_t res = iconv(cd_, &inbuf, &left, &outbuf, &outleft);
+		in += len - left;
+		inleft -= len - left;
+		out = (unsigned char*)outbuf;
+
+		if (res != (size_t)(-1) || left < len) {
+			return true;
+		}
+		return setResult(res);
+	}
+
+	inline bool EncodingConverter::convertFast(const unsigned char*& in, size_t& inleft,
+		unsigned char*& out, size_t& outleft)
+	{
+		bool ascii = (!fromTable_ || fromTable_->asciiCompatible()) && (!toTable_ || toTable_->asciiCompatible());
+		bool utf16 = (form_ == FORM_UTF16LE || form_ == FORM_UTF16BE);
+		bool bigEndian = (form_ == FORM_UTF16BE);
+
+		while (inleft > 0) {
+			if (ascii) {
+				size_t n = inleft;
+				if (!utf16) {
+					n = (n < outleft) ? n : outleft;
+				} else if (fast_ == FAST_DECODE) {
+					n = (n < outleft / 2) ? n : outleft / 2;
+				}
+				if (!utf16) {
+					n = SingleByteTable::asciiPrefix(in, n);
+					memcpy(out, in, n);
+					in += n;
+					inleft -= n;
+					out += n;
+					outleft -= n;
+				} else if (fast_ == FAST_DECODE) {
+					n = SingleByteTable::asciiPrefix(in, n);
+					SingleByteTable::widenAscii(in, n, out, bigEndian);
+					in += n;
+					inleft -= n;
+					out += 2 * n;
+					outleft -= 2 * n;
+				}
+				if (inleft == 0) {
+					break;
+				}
+			}
+			if (outleft == 0) {
+				result_ = RESULT_OUTPUT_FULL;
+				return false;
+			}
+
+			if (fast_ == FAST_DECODE) {
+				unsigned char b = *in;
+				unsigned long cp = fromTable_->toUnicode(b);
+				if (!utf16) {
+					size_t len = fromTable_->utf8Length(b);
+					if (len == 0) {
+						if (!convertSlow(in, inleft, 1, out, outleft)) return false;
+						continue;
+					}
+					if (outleft < len) {
+						result_ = RESULT_OUTPUT_FULL;
+						return false;
+					}
+					memcpy(out, fromTable_->utf8(b), len);
+					out += len;
+					outleft -= len;
+				} else {
+					if (cp > 0xFFFF) {
+						if (!convertSlow(in, inleft, 1, out, outleft)) return false;
+						continue;
+					}
+					if (outleft < 2) {
+						result_ = RESULT_OUTPUT_FULL;
+						return false;
+					}
+					out[bigEndian ? 0 : 1] = (unsigned char)(cp >> 8);
+					out[bigEndian ? 1 : 0] = (unsigned char)cp;
+					out += 2;
+					outleft -= 2;
+				}
+				++in;
+				--inleft;
+			} else if (fast_ == FAST_RECODE) {
+				unsigned long cp = fromTable_->toUnicode(*in);
+				int b = (cp == SingleByteTable::UNMAPPED) ? -1 : toTable_->fromUnicode(cp);
+				if (b < 0) {
+					if (!convertSlow(in, inleft, 1, out, outleft)) return false;
+					continue;
+				}
+				*out++ = (unsigned char)b;
+				--outleft;
+				++in;
+				--inleft;
+			} else {
+				// FAST_ENCODE: decode one character. Anything unusual goes to iconv.
+				unsigned long cp = 0;
+				size_t len = 0;
+				if (utf16) {
+					len = 2;
+					if (inleft >= 2) {
+						cp = bigEndian ? ((unsigned long)in[0] << 8 | in[1]) : ((unsigned long)in[1] << 8 | in[0]);
+						if (cp >= 0xD800 && cp <= 0xDFFF) {
+							len = (inleft < 4) ? inleft : 4;
+							cp = SingleByteTable::UNMAPPED;
+						}
+					} else {
+						len = inleft;
+						cp = SingleByteTable::UNMAPPED;
+					}
+				} else {
+					unsigned char c = in[0];
+					len = (c < 0x80) ? 1 : (c >= 0xC2 && c <= 0xDF) ? 2 : (c >= 0xE0 && c <= 0xEF) ? 3 : 0;
+					if (len == 0 || len > inleft) {
+						len = (inleft < 4) ? inleft : 4;
+						cp = SingleByteTable::UNMAPPED;
+					} else if (len == 1) {
+						cp = c;
+					} else if (len == 2) {
+						cp = ((in[1] & 0xC0) == 0x80) ? ((unsigned long)(c & 0x1F) << 6 | (in[1] & 0x3F)) : SingleByteTable::UNMAPPED;
+					} else {
+						cp = ((in[1] & 0xC0) == 0x80 && (in[2] & 0xC0) == 0x80) ?
+							((unsigned long)(c & 0x0F) << 12 | (unsigned long)(in[1] & 0x3F) << 6 | (in[2] & 0x3F)) :
+							SingleByteTable::UNMAPPED;
+						if (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)) {
+							cp = SingleByteTable::UNMAPPED;
+						}
+					}
+				}
+				int b = (cp == SingleByteTable::UNMAPPED) ? -1 : toTable_->fromUnicode(cp);
+				if (b < 0) {
+					if (!convertSlow(in, inleft, len, out, outleft)) return false;
+					continue;
+				}
+				*out++ = (unsigned char)b;
+				--outleft;
+				in += len;
+				inleft -= len;
+			}
+		}
+
+		result_ = RESULT_OK;
+		return true;
+	}
+
 #endif
 
 
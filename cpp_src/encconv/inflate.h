@@ -0,0 +1,179 @@
+﻿/*
+** The author disclaims copyright to this source code.
+** In place of a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+*/
+/*
+** Any feedback would be appreciated.
+** mailto:k-tak@void.in
+*/
+#ifndef ___PORTPP_INFLATE_H___
+#define ___PORTPP_INFLATE_H___
+
+#include <cstddef>
+
+#ifdef PORTPP_USE_ZLIB
+#include <zlib.h>
+#include <climits>
+#include <cstring>
+#endif
+
+
+namespace portpp {
+
+
+	/**
+	* Incremental zlib decompressor, with the same calling convention as TransferDecoder.
+	* Concatenated streams (as in "cat a.gz b.gz") are decompressed one after another.
+	* Without PORTPP_USE_ZLIB, valid() is always false.
+	*/
+	class Inflater
+	{
+	public:
+		enum FORMAT
+		{
+			FORMAT_NONE		= 0, // Not compressed.
+			FORMAT_GZIP		= 1, // gzip (RFC 1952).
+			FORMAT_ZLIB		= 2, // zlib (RFC 1950).
+			FORMAT_DEFLATE	= 3, // Raw deflate (RFC 1951).
+			FORMAT_AUTO		= 4, // gzip or zlib, whichever the header says.
+		};
+
+	protected:
+		FORMAT			format_;
+		bool			valid_;
+		bool			failed_;	// The data turned out to be corrupt.
+		bool			ended_;		// At the end of a stream.
+#ifdef PORTPP_USE_ZLIB
+		z_stream		zs_;
+#endif
+
+		Inflater(const Inflater&);
+		Inflater& operator=(const Inflater&);
+
+	public:
+		/**
+		* Constructor.
+		* @param format Format of the compressed data.
+		*/
+		Inflater(FORMAT format) : format_(format), valid_(false), failed_(false), ended_(false)
+		{
+#ifdef PORTPP_USE_ZLIB
+			int bits = 15;
+			switch (format_) {
+			case FORMAT_GZIP:		bits = 15 + 16; break;
+			case FORMAT_DEFLATE:	bits = -15; break;
+			case FORMAT_AUTO:		bits = 15 + 32; break;
+			default:				break;
+			}
+			memset(&zs_, 0, sizeof(zs_));
+			valid_ = (inflateInit2(&zs_, bits) == Z_OK);
+#endif
+		}
+
+		~Inflater()
+		{
+#ifdef PORTPP_USE_ZLIB
+			if (valid_) {
+				inflateEnd(&zs_);
+			}
+#endif
+		}
+
+		/**
+		* Returns true if the decompressor was successfully initialized.
+		* @return true/false.
+		*/
+		bool valid() const { return valid_; }
+
+		/**
+		* Returns true if the data was found to be corrupt. Nothing more is decompressed then.
+		* @return true/false.
+		*/
+		bool failed() const { return failed_; }
+
+		/**
+		* Returns true if the input so far ends exactly at the end of a stream.
+		* @return true/false.
+		*/
+		bool ended() const { return ended_; }
+
+		/**
+		* Decompresses input and stores the result into output.
+		* Call it again with no input until it stores nothing, to get all the output for the input so far.
+		* @param input [in] Compressed data.
+		* @param inputBytesLeft [in/out] Size of input in bytes.
+		*        It will be subtracted by the number of bytes consumed when the method returns.
+		* @param output [out] A buffer to be stored with decompressed data.
+		* @param outputBytesLeft [in/out] Size of output in bytes.
+		*        It will be subtracted by the number of bytes stored when the method returns.
+		*/
+		void decode(const void* input, size_t& inputBytesLeft, void* output, size_t& outputBytesLeft)
+		{
+#ifdef PORTPP_USE_ZLIB
+			const unsigned char* in = static_cast<const unsigned char*>(input);
+			unsigned char* out = static_cast<unsigned char*>(output);
+
+			// Output held back by zlib is drained even when there is no more input.
+			while (valid_ && !failed_ && outputBytesLeft > 0) {
+				if (ended_) {
+					if (inputBytesLeft == 0) {
+						break;
+					}
+					// Another stream follows.
+					inflateReset(&zs_);
+					ended_ = false;
+				}
+
+				uInt inlen = (inputBytesLeft < UINT_MAX) ? (uInt)inputBytesLeft : UINT_MAX;
+				uInt outlen = (outputBytesLeft < UINT_MAX) ? (uInt)outputBytesLeft : UINT_MAX;
+				zs_.next_in = const_cast<Bytef*>(in);
+				zs_.avail_in = inlen;
+				zs_.next_out = out;
+				zs_.avail_out = outlen;
+
+				int r = ::inflate(&zs_, Z_NO_FLUSH);
+
+				in += inlen - zs_.avail_in;
+				inputBytesLeft -= inlen - zs_.avail_in;
+				out += outlen - zs_.avail_out;
+				outputBytesLeft -= outlen - zs_.avail_out;
+
+				if (r == Z_STREAM_END) {
+					ended_ = true;
+				} else if (r == Z_BUF_ERROR) {
+					break;
+				} else if (r != Z_OK) {
+					failed_ = true;
+				}
+			}
+#else
+			(void)input;
+			(void)inputBytesLeft;
+			(void)output;
+			(void)outputBytesLeft;
+#endif
+		}
+
+		/**
+		* Reinitializes the internal state.
+		*/
+		void reset()
+		{
+#ifdef PORTPP_USE_ZLIB
+			if (valid_) {
+				inflateReset(&zs_);
+			}
+#endif
+			failed_ = false;
+			ended_ = false;
+		}
+	};
+
+
+}; // end of namespace portpp
+
+#endif
@@ -0,0 +1,339 @@
+﻿/*
+** The author disclaims copyright to this source code.
+** In place of a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+*/
+/*
+** Any feedback would be appreciated.
+** mailto:k-tak@void.in
+*/
+#ifndef ___PORTPP_SBCS_H___
+#define ___PORTPP_SBCS_H___
+
+#include <iconv.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <pthread.h>
+#endif
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define PORTPP_SBCS_USE_SSE2
+#endif
+
+
+namespace portpp {
+
+
+	/**
+	* Lookup tables for a single-byte charset (ISO-8859-x, Windows-125x, KOI8-R and the like).
+	* The tables are derived from iconv itself, so they agree with it byte for byte.
+	*/
+	class SingleByteTable
+	{
+	public:
+		static const unsigned long UNMAPPED = 0xFFFFFFFFUL;
+
+	protected:
+		unsigned long			toUnicode_[256];
+		unsigned char			utf8_[256][4];
+		unsigned char			utf8Length_[256];	// 0 if the byte is unmapped.
+		// Two-level reverse table for U+0000..U+FFFF.
+		// pages_[pageIndex_[cp >> 8] * 256 + (cp & 0xFF)] is the byte for cp, or 0xFFFF.
+		// Page 0 is all 0xFFFF and shared by every unused page.
+		unsigned char			pageIndex_[256];
+		std::vector<unsigned short>	pages_;
+		bool					asciiCompatible_;
+
+	public:
+		SingleByteTable() : asciiCompatible_(false) {}
+
+		/**
+		* Returns the tables for encoding, built on first use and shared by every caller.
+		* They are never changed or freed afterwards, so they can be read without locking.
+		* @param encoding Charset name as iconv knows it.
+		* @return null if encoding is not a stateless single-byte charset.
+		*/
+		static const SingleByteTable* find(const char* encoding)
+		{
+			// Aliases which differ in case, '-' or '_' only share the tables.
+			std::string key;
+			for (const char* p = encoding; *p; ++p) {
+				if (*p != '-' && *p != '_') {
+					key += (char)toupper((unsigned char)*p);
+				}
+			}
+
+			Registry& reg = registry();
+			reg.lock();
+			if (!reg.tables) {
+				reg.tables = new std::map<std::string, const SingleByteTable*>();
+			}
+			std::map<std::string, const SingleByteTable*>::iterator it = reg.tables->find(key);
+			if (it == reg.tables->end()) {
+				// Charsets which have no tables are remembered too, so they are probed once.
+				SingleByteTable* table = new SingleByteTable();
+				if (!table->build(encoding)) {
+					delete table;
+					table = 0;
+				}
+				it = reg.tables->insert(std::make_pair(key, (const SingleByteTable*)table)).first;
+			}
+			const SingleByteTable* table = it->second;
+			reg.unlock();
+
+			return table;
+		}
+
+		/**
+		* Builds the tables for encoding.
+		* @param encoding Charset name as iconv knows it.
+		* @return false if encoding is not a stateless single-byte charset.
+		*/
+		bool build(const char* encoding)
+		{
+			iconv_t dec = iconv_open("UCS-4BE", encoding);
+			if (dec == (iconv_t)(-1)) {
+				return false;
+			}
+
+			// Multi-byte charsets are rejected at their first lead byte, so try the high half first.
+			bool ok = true;
+			for (int i = 0; i < 256 && ok; ++i) {
+				unsigned char b = (unsigned char)((i + 0x80) & 0xFF);
+				unsigned char ucs4[8];
+				char* inbuf = (char*)&b;
+				char* outbuf = (char*)ucs4;
+				size_t inleft = 1;
+				size_t outleft = sizeof(ucs4);
+
+				iconv(dec, NULL, NULL, NULL, NULL);
+				if (iconv(dec, &inbuf, &inleft, &outbuf, &outleft) == (size_t)(-1)) {
+					// EINVAL means b begins a longer sequence.
+					ok = (errno == EILSEQ);
+					toUnicode_[b] = UNMAPPED;
+					continue;
+				}
+				// A charset which holds characters back (e.g. for combining marks) is not a plain table.
+				ok = (outleft == sizeof(ucs4) - 4 &&
+					iconv(dec, NULL, NULL, &outbuf, &outleft) != (size_t)(-1) &&
+					outleft == sizeof(ucs4) - 4);
+				toUnicode_[b] = ((unsigned long)ucs4[0] << 24) | ((unsigned long)ucs4[1] << 16) |
+					((unsigned long)ucs4[2] << 8) | (unsigned long)ucs4[3];
+				ok = ok && (toUnicode_[b] <= 0x10FFFF);
+			}
+			iconv_close(dec);
+
+			return ok && buildReverse(encoding);
+		}
+
+		/**
+		* Returns the code point for byte b, or UNMAPPED.
+		*/
+		unsigned long toUnicode(unsigned char b) const { return toUnicode_[b]; }
+
+		/**
+		* Returns the UTF-8 form of byte b. Its length is given by utf8Length().
+		*/
+		const unsigned char* utf8(unsigned char b) const { return utf8_[b]; }
+
+		/**
+		* Returns the length of the UTF-8 form of byte b, or 0 if b is unmapped.
+		*/
+		size_t utf8Length(unsigned char b) const { return utf8Length_[b]; }
+
+		/**
+		* Returns the byte for code point cp, or -1 if it has none in the table.
+		*/
+		int fromUnicode(unsigned long cp) const
+		{
+			if (cp > 0xFFFF) {
+				return -1;
+			}
+			unsigned short b = pages_[pageIndex_[cp >> 8] * 256 + (cp & 0xFF)];
+			return (b == 0xFFFF) ? -1 : (int)b;
+		}
+
+		/**
+		* Returns true if bytes 0x00-0x7F are ASCII in both directions.
+		*/
+		bool asciiCompatible() const { return asciiCompatible_; }
+
+		/**
+		* Returns the length of the leading run of bytes below 0x80 in p[0..n).
+		*/
+		static size_t asciiPrefix(const unsigned char* p, size_t n)
+		{
+			size_t i = 0;
+#ifdef PORTPP_SBCS_USE_SSE2
+			for (; i + 16 <= n; i += 16) {
+				if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)))) {
+					break;
+				}
+			}
+#endif
+			for (; i + 8 <= n; i += 8) {
+				unsigned long long w;
+				memcpy(&w, p + i, sizeof(w));
+				if (w & 0x8080808080808080ULL) {
+					break;
+				}
+			}
+			while (i < n && p[i] < 0x80) {
+				++i;
+			}
+			return i;
+		}
+
+		/**
+		* Widens n ASCII bytes to UTF-16. out must have room for 2*n bytes.
+		*/
+		static void widenAscii(const unsigned char* in, size_t n, unsigned char* out, bool bigEndian)
+		{
+			size_t i = 0;
+#ifdef PORTPP_SBCS_USE_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + 16 <= n; i += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+				__m128i lo = bigEndian ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero);
+				__m128i hi = bigEndian ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero);
+				_mm_storeu_si128((__m128i*)(out + 2 * i), lo);
+				_mm_storeu_si128((__m128i*)(out + 2 * i + 16), hi);
+			}
+#endif
+			for (; i < n; ++i) {
+				out[2 * i + (bigEndian ? 0 : 1)] = 0;
+				out[2 * i + (bigEndian ? 1 : 0)] = in[i];
+			}
+		}
+
+	protected:
+		// The tables of find(), by normalized charset name. Initialized statically, so the
+		// first callers can't race on it.
+		struct Registry
+		{
+#ifdef _WIN32
+			SRWLOCK				srw;
+			void lock() { AcquireSRWLockExclusive(&srw); }
+			void unlock() { ReleaseSRWLockExclusive(&srw); }
+#else
+			pthread_mutex_t		mutex;
+			void lock() { pthread_mutex_lock(&mutex); }
+			void unlock() { pthread_mutex_unlock(&mutex); }
+#endif
+			std::map<std::string, const SingleByteTable*>*	tables;
+		};
+
+		static Registry& registry()
+		{
+#ifdef _WIN32
+			static Registry reg = { SRWLOCK_INIT, 0 };
+#else
+			static Registry reg = { PTHREAD_MUTEX_INITIALIZER, 0 };
+#endif
+			return reg;
+		}
+
+		bool buildReverse(const char* encoding)
+		{
+			iconv_t enc = iconv_open(encoding, "UCS-4BE");
+			if (enc == (iconv_t)(-1)) {
+				return false;
+			}
+
+			memset(pageIndex_, 0, sizeof(pageIndex_));
+			pages_.assign(256, 0xFFFF);
+
+			// Ask iconv for the byte of every code point the charset decodes to,
+			// in case two bytes decode to the same character.
+			bool ok = true;
+			for (int b = 0; b < 256 && ok; ++b) {
+				unsigned long cp = toUnicode_[b];
+				utf8Length_[b] = 0;
+				if (cp == UNMAPPED) {
+					continue;
+				}
+				encodeUtf8(cp, utf8_[b], utf8Length_[b]);
+				if (cp > 0xFFFF) {
+					continue;
+				}
+
+				unsigned char ucs4[4] = {
+					(unsigned char)(cp >> 24), (unsigned char)(cp >> 16), (unsigned char)(cp >> 8), (unsigned char)cp
+				};
+				unsigned char out[8];
+				char* inbuf = (char*)ucs4;
+				char* outbuf = (char*)out;
+				size_t inleft = sizeof(ucs4);
+				size_t outleft = sizeof(out);
+
+				iconv(enc, NULL, NULL, NULL, NULL);
+				if (iconv(enc, &inbuf, &inleft, &outbuf, &outleft) == (size_t)(-1) ||
+					outleft != sizeof(out) - 1)
+				{
+					continue;
+				}
+
+				if (pageIndex_[cp >> 8] == 0) {
+					if (pages_.size() / 256 >= 256) {
+						ok = false;
+						break;
+					}
+					pageIndex_[cp >> 8] = (unsigned char)(pages_.size() / 256);
+					pages_.resize(pages_.size() + 256, 0xFFFF);
+				}
+				pages_[pageIndex_[cp >> 8] * 256 + (cp & 0xFF)] = out[0];
+			}
+			iconv_close(enc);
+
+			asciiCompatible_ = true;
+			for (int b = 0; b < 0x80; ++b) {
+				if (toUnicode_[b] != (unsigned long)b || fromUnicode((unsigned long)b) != b) {
+					asciiCompatible_ = false;
+					break;
+				}
+			}
+
+			return ok;
+		}
+
+		static void encodeUtf8(unsigned long cp, unsigned char* out, unsigned char& len)
+		{
+			if (cp < 0x80) {
+				out[0] = (unsigned char)cp;
+				len = 1;
+			} else if (cp < 0x800) {
+				out[0] = (unsigned char)(0xC0 | (cp >> 6));
+				out[1] = (unsigned char)(0x80 | (cp & 0x3F));
+				len = 2;
+			} else if (cp < 0x10000) {
+				out[0] = (unsigned char)(0xE0 | (cp >> 12));
+				out[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+				out[2] = (unsigned char)(0x80 | (cp & 0x3F));
+				len = 3;
+			} else {
+				out[0] = (unsigned char)(0xF0 | (cp >> 18));
+				out[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+				out[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+				out[3] = (unsigned char)(0x80 | (cp & 0x3F));
+				len = 4;
+			}
+		}
+	};
+
+
+}; // end of namespace portpp
+
+#endif
@@ -0,0 +1,181 @@
+﻿/*
+** The author disclaims copyright to this source code.
+** In place of a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+*/
+/*
+** Any feedback would be appreciated.
+** mailto:k-tak@void.in
+*/
+#ifndef ___PORTPP_TRANSFER_H___
+#define ___PORTPP_TRANSFER_H___
+
+#include <cstddef>
+
+
+namespace portpp {
+
+
+	/**
+	* Incremental decoder for MIME transfer encodings (RFC 2045 / RFC 2047).
+	* The decoder keeps its state between calls, so input can be fed in arbitrary pieces.
+	*/
+	class TransferDecoder
+	{
+	public:
+		enum ENCODING
+		{
+			TRANSFER_NONE				= 0, // Identity.
+			TRANSFER_BASE64				= 1, // Base64 (RFC 2045 6.8, RFC 2047 "B").
+			TRANSFER_QUOTED_PRINTABLE	= 2, // Quoted-Printable (RFC 2045 6.7).
+			TRANSFER_Q					= 3, // RFC 2047 "Q" encoding. Same as Quoted-Printable except '_' means a space.
+		};
+
+	protected:
+		ENCODING		enc_;
+		unsigned long	bits_;		// Base64: pending bits.
+		int				nbits_;		// Base64: number of pending bits.
+		char			esc_[2];	// Quoted-Printable: characters seen after '='.
+		int				nesc_;		// Quoted-Printable: -1 if not in an escape, otherwise length of esc_.
+
+		static int hexValue(unsigned char c)
+		{
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			return -1;
+		}
+
+		static int base64Value(unsigned char c)
+		{
+			if (c >= 'A' && c <= 'Z') return c - 'A';
+			if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+			if (c >= '0' && c <= '9') return c - '0' + 52;
+			if (c == '+') return 62;
+			if (c == '/') return 63;
+			return -1;
+		}
+
+	public:
+		/**
+		* Constructor.
+		* @param enc Transfer encoding of the input.
+		*/
+		TransferDecoder(ENCODING enc = TRANSFER_NONE) : enc_(enc) { reset(); }
+
+		/**
+		* Returns the transfer encoding.
+		* @return Transfer encoding.
+		*/
+		ENCODING encoding() const { return enc_; }
+
+		/**
+		* Changes the transfer encoding and reinitializes the internal state.
+		* @param enc Transfer encoding of the input.
+		*/
+		void setEncoding(ENCODING enc) { enc_ = enc; reset(); }
+
+		/**
+		* Reinitializes the internal state of the decoder.
+		*/
+		void reset()
+		{
+			bits_ = 0;
+			nbits_ = 0;
+			nesc_ = -1;
+		}
+
+		/**
+		* Decodes input and stores result into output.
+		* Characters which are not part of the encoding (e.g. line breaks in Base64) are skipped.
+		* Malformed Quoted-Printable escapes are copied as they are.
+		* @param input [in] Input byte sequence.
+		* @param inputBytesLeft [in/out] Size of input in bytes.
+		*        It will be subtracted by the number of bytes consumed when the method returns.
+		* @param output [out] A buffer to be stored with output byte sequence.
+		* @param outputBytesLeft [in/out] Size of output in bytes.
+		*        It will be subtracted by the number of bytes stored when the method returns.
+		*        The decoder stops consuming input when less than 3 bytes are left.
+		*/
+		void decode(const void* input, size_t& inputBytesLeft,
+			void* output, size_t& outputBytesLeft)
+		{
+			const unsigned char* in = static_cast<const unsigned char*>(input);
+			unsigned char* out = static_cast<unsigned char*>(output);
+
+			while (inputBytesLeft > 0 && outputBytesLeft >= 3) {
+				unsigned char c = *in++;
+				--inputBytesLeft;
+
+				switch (enc_) {
+				case TRANSFER_BASE64:
+					{
+						int v = base64Value(c);
+						if (v < 0) {
+							if (c == '=') {
+								// Padding terminates a group. Drop its leftover bits.
+								nbits_ = 0;
+							}
+							break;
+						}
+						bits_ = ((bits_ << 6) | (unsigned long)v) & 0xFFFFFF;
+						nbits_ += 6;
+						if (nbits_ >= 8) {
+							nbits_ -= 8;
+							*out++ = (unsigned char)(bits_ >> nbits_);
+							--outputBytesLeft;
+						}
+					}
+					break;
+
+				case TRANSFER_QUOTED_PRINTABLE:
+				case TRANSFER_Q:
+					if (nesc_ < 0) {
+						if (c == '=') {
+							nesc_ = 0;
+						} else {
+							*out++ = (c == '_' && enc_ == TRANSFER_Q) ? ' ' : c;
+							--outputBytesLeft;
+						}
+					} else if (nesc_ == 1 && esc_[0] == '\r') {
+						// "=\r\n" is a soft line break.
+						nesc_ = -1;
+						if (c != '\n') {
+							*out++ = '=';
+							*out++ = '\r';
+							*out++ = c;
+							outputBytesLeft -= 3;
+						}
+					} else if (nesc_ == 0 && c == '\n') {
+						nesc_ = -1;
+					} else if (nesc_ == 0 && (c == '\r' || hexValue(c) >= 0)) {
+						esc_[nesc_++] = (char)c;
+					} else if (nesc_ == 1 && hexValue(c) >= 0) {
+						*out++ = (unsigned char)((hexValue(esc_[0]) << 4) | hexValue(c));
+						--outputBytesLeft;
+						nesc_ = -1;
+					} else {
+						*out++ = '=';
+						if (nesc_ == 1) *out++ = esc_[0];
+						*out++ = c;
+						outputBytesLeft -= 2 + nesc_;
+						nesc_ = -1;
+					}
+					break;
+
+				default:
+					*out++ = c;
+					--outputBytesLeft;
+					break;
+				}
+			}
+		}
+	};
+
+
+}; // end of namespace portpp
+
+#endif
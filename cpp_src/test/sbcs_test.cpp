@@ -0,0 +1,158 @@
+// Checks the table-driven conversions of EncodingConverter against plain iconv on random input.
+// Exits with 1 if any conversion differs in its output, the input it consumed or how it ended.
+#include "../encconv/encconv.h"
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+using portpp::EncodingConverter;
+using portpp::SingleByteTable;
+
+// Charsets with tables, and the encodings they are converted from and to.
+static const char* const SINGLE_BYTE[] = {
+    "ISO-8859-1", "ISO-8859-2", "ISO-8859-5", "ISO-8859-7", "ISO-8859-15", "CP1250", "CP1251",
+    "CP1252", "CP1255", "CP1258", "KOI8-R", "KOI8-U", "CP437", "CP850", "CP037", "US-ASCII"
+};
+static const char* const OTHERS[] = {"UTF-8", "UTF-16LE", "UTF-16BE", "ISO-8859-15", "CP1251"};
+static const int ROUNDS = 20;
+
+// Outcome of one conversion.
+struct Outcome
+{
+    std::string out;
+    size_t left;    // Input bytes not consumed.
+    bool ok;        // The last call succeeded.
+
+    bool operator==(const Outcome& o) const { return out == o.out && left == o.left && ok == o.ok; }
+};
+
+// Converts in through iconv directly, outsize bytes of output at a time, until it gets stuck.
+static Outcome convert_iconv(const char* from, const char* to, int opt, const std::string& in, size_t outsize)
+{
+    std::string tocode(to);
+    if (opt & EncodingConverter::CONVERT_TRANSLITERATE) {
+        tocode += "//TRANSLIT";
+    }
+    if (opt & EncodingConverter::CONVERT_DISCARD_ILSEQ) {
+        tocode += "//IGNORE";
+    }
+    iconv_t cd = iconv_open(tocode.c_str(), from);
+
+    Outcome r;
+    char* inbuf = const_cast<char*>(in.data());
+    r.left = in.size();
+    r.ok = true;
+    for (;;) {
+        char buf[4096];
+        char* outbuf = buf;
+        size_t outleft = outsize;
+        size_t prevlen = r.left;
+        r.ok = (iconv(cd, &inbuf, &r.left, &outbuf, &outleft) != (size_t)(-1));
+        r.out.append(buf, outsize - outleft);
+        if (r.ok || (prevlen == r.left && outleft == outsize)) {
+            break;
+        }
+    }
+    iconv_close(cd);
+
+    return r;
+}
+
+// Same through EncodingConverter.
+static Outcome convert_fast(EncodingConverter& conv, const std::string& in, size_t outsize)
+{
+    Outcome r;
+    const char* inbuf = in.data();
+    r.left = in.size();
+    r.ok = true;
+    for (;;) {
+        char buf[4096];
+        size_t outleft = outsize;
+        size_t prevlen = r.left;
+        r.ok = conv.convert(inbuf + (in.size() - r.left), r.left, buf, outleft);
+        r.out.append(buf, outsize - outleft);
+        if (r.ok || (prevlen == r.left && outleft == outsize)) {
+            break;
+        }
+    }
+
+    return r;
+}
+
+// Random text: mostly ASCII, some bytes from the upper half, now and then a character
+// the charset may lack. Anything which is not single-byte is made by converting it.
+static std::string random_text(const char* enc)
+{
+    static const char* const EXTRA = "\xE2\x82\xAC\xF0\x9F\x98\x80\xE2\x80\x94\xC5\x93";
+    std::string latin;
+    int n = rand() % 2000;
+    for (int i = 0; i < n; ++i) {
+        latin += (char)((rand() % 4) ? rand() % 128 : rand() % 256);
+    }
+    if (!SingleByteTable::find(enc)) {
+        size_t left = latin.size();
+        EncodingConverter dec("CP1251", "UTF-8", EncodingConverter::CONVERT_DISCARD_ILSEQ);
+        std::string text = dec.convert(latin.data(), left);
+        text.insert(text.size() / 2, EXTRA);
+        left = text.size();
+        EncodingConverter enc8("UTF-8", enc, EncodingConverter::CONVERT_DISCARD_ILSEQ);
+        return enc8.convert(text.data(), left);
+    }
+    return latin;
+}
+
+int main()
+{
+    int tests = 0;
+    int failures = 0;
+
+    // Aliases share their tables; multi-byte charsets have none.
+    if (SingleByteTable::find("ISO-8859-1") != SingleByteTable::find("iso_8859-1") ||
+        !SingleByteTable::find("ISO-8859-1") || SingleByteTable::find("SHIFT_JIS"))
+    {
+        printf("SingleByteTable::find() is not shared\n");
+        ++failures;
+    }
+
+    srand(1);
+    for (size_t s = 0; s < sizeof(SINGLE_BYTE) / sizeof(SINGLE_BYTE[0]); ++s) {
+        for (size_t o = 0; o < sizeof(OTHERS) / sizeof(OTHERS[0]); ++o) {
+            for (int dir = 0; dir < 2; ++dir) {
+                const char* from = dir ? OTHERS[o] : SINGLE_BYTE[s];
+                const char* to = dir ? SINGLE_BYTE[s] : OTHERS[o];
+                for (int opt = 0; opt < 3; ++opt) {
+                    EncodingConverter conv(from, to, (EncodingConverter::OPTION)opt);
+                    if (!conv.valid()) {
+                        continue;
+                    }
+                    for (int round = 0; round < ROUNDS; ++round) {
+                        std::string in = random_text(from);
+                        if (round % 5 == 1 && !in.empty()) {
+                            in[rand() % in.size()] = (char)0xFF;
+                        }
+                        if (round % 7 == 2 && !in.empty()) {
+                            in.resize(in.size() - 1);
+                        }
+                        // Small output buffers stop the conversion in the middle of the input.
+                        size_t outsize = (round % 2) ? 4096 : 4 + rand() % 60;
+
+                        conv.reset();
+                        Outcome fast = convert_fast(conv, in, outsize);
+                        Outcome ref = convert_iconv(from, to, opt, in, outsize);
+                        ++tests;
+                        if (!(fast == ref)) {
+                            if (++failures <= 10) {
+                                printf("%s -> %s, option %d, round %d: %u/%u bytes out, %u/%u left\n",
+                                    from, to, opt, round, (unsigned)fast.out.size(), (unsigned)ref.out.size(),
+                                    (unsigned)fast.left, (unsigned)ref.left);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%d conversions, %d different from iconv\n", tests, failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -1,7 +1,9 @@
 -module(encconv).
--export([initialize/0, uninitialize/0, convert_binary/3, convert_binary/4,
+-export([initialize/0, uninitialize/0, preopen/1, cache_configure/1, cache_info/0, cache_clear/0,
+         convert_binary/3, convert_binary/4, decode_mime_header/2, decode_mime_header/3,
          create_converter/3, destroy_converter/1, do_convert/2, flush_converter/1, reset_converter/1,
-         convert_list/3, convert_list/4]).
+         convert_list/3, convert_list/4, convert_multi/4, find/4,
+         latency_histograms/0, latency_clear/0]).
 -on_load(nifinit/0).
 
 nifinit() ->
@@ -20,7 +22,12 @@ nifinit() ->
     Dir ->
       filename:join(Dir, NifFile)
   end,
-  ok = erlang:load_nif(LibName, 0).
+  % Encoding pairs to open while loading, so the first conversions don't pay for it.
+  Preopen = case application:get_env(encconv, preopen) of
+    {ok, Pairs} when is_list(Pairs) -> Pairs;
+    _ -> []
+  end,
+  ok = erlang:load_nif(LibName, Preopen).
 
 % Always returns ok.
 initialize() ->
@@ -30,19 +37,112 @@ initialize() ->
 uninitialize() ->
 	exit(nif_library_not_loaded).
 
-% Returns {ok, ConvertedBin} when succeeded.
+% Opens converters for [{InEnc, OutEnc} | {InEnc, OutEnc, Option}] and keeps them
+% for later conversions. {InEnc, OutEnc} stands for the pair convert_binary/3 uses.
+preopen(_Pairs) ->
+	exit(nif_library_not_loaded).
+
+% Sets up the cache of convert_binary/3,4 results, given [{max_input, Bytes} | {max_memory, Bytes}].
+% Results for inputs up to max_input bytes (default 1024) are kept, least recently used
+% dropped first, while the cache takes max_memory bytes at most. It is off while
+% max_memory is 0, which is the default. Only {output, binary} results are cached.
+cache_configure(_Options) ->
+	exit(nif_library_not_loaded).
+
+% Returns [{hits, N}, {misses, N}, {entries, N}, {memory, Bytes}, {max_input, Bytes}, {max_memory, Bytes}].
+cache_info() ->
+	exit(nif_library_not_loaded).
+
+% Empties the cache. Always returns ok.
+cache_clear() ->
+	exit(nif_library_not_loaded).
+
+% Returns [{{InEnc, OutEnc} | other, [{UpperBoundNs | infinity, Count}]}]: how long the
+% conversions of each pair took, counted in buckets of powers of two nanoseconds.
+% A bucket counts the conversions which took less than its bound and at least half of it.
+% Empty buckets are left out. convert_binary/3,4 and convert_list/3,4 calls count once
+% each, failed ones included, unless the pair can't be converted at all or the result
+% comes from the cache; so does each do_convert/2 call. Up to 256 pairs are listed on
+% their own; conversions between any other pairs are counted under other.
+% For a closer look, the library has USDT probes (provider encconv) when built with
+% sys/sdt.h: converter_create, converter_destroy, converter_open, output_alloc,
+% convert_start, convert_end and convert_error.
+latency_histograms() ->
+	exit(nif_library_not_loaded).
+
+% Forgets all pairs and their latency histograms. Always returns ok.
+latency_clear() ->
+	exit(nif_library_not_loaded).
+
+% Returns {ok, ConvertedBin, RestLen} when succeeded.
 convert_binary(_Data, _InEnc, _OutEnc) ->
 	exit(nif_library_not_loaded).
 
+% Option is a list of
+%   translit | ignore |
+%   {transfer_encoding, none | base64 | quoted_printable} |
+%   {inflate, none | gzip | zlib | deflate | auto} |
+%   {fallback, none | xml_charref | html_entity | backslash_u | {replace, Bin}} |
+%   {output, binary | iolist | codepoints} |
+%   {map, [{FromCodepoint, ToCodepoint | Bytes}]}.
+% With {output, iolist}, the result is a list of binaries of 65536 bytes each (the last one
+% shorter) rather than one binary, which keeps peak memory low for large inputs.
+% With {output, codepoints}, the result is a list of code points; OutEnc must then be
+% a Unicode encoding (UTF-* or UCS-*), and only tells that Unicode is wanted.
+% With map, the characters FromCodepoint are written out as ToCodepoint, or as Bytes
+% (given in OutEnc), instead of what iconv would make of them; e.g. {16#301C, 16#FF5E}
+% turns the wave dash of Shift_JIS into the fullwidth tilde CP932 uses. InEnc must not
+% be a stateful encoding such as ISO-2022-JP, nor one whose byte order is told by a BOM
+% such as UTF-16 (give UTF-16LE or UTF-16BE instead). create_converter/3 compiles the map once
+% for all the conversions made with the converter.
+% With transfer_encoding, Data is decoded from Base64/Quoted-Printable on the fly.
+% With inflate, Data (after transfer decoding) is decompressed on the fly; auto takes
+% either gzip or zlib by the header. Concatenated gzip members are read one after
+% another. Offsets are then counted in the decompressed data. Corrupt data gives
+% {error, {corrupt_stream, Offset}, PartialBin}, and data which ends before the stream
+% does {error, {incomplete, Offset}, PartialBin}. The NIF must have been built with zlib.
+% With fallback, characters which can't be converted are written out as &#N;, &name;,
+% \uXXXX or Bin (given in OutEnc) instead, and invalid input bytes as U+FFFD.
+% Without ignore, returns {error, {invalid_sequence | incomplete, Offset}, PartialBin}
+% if the input can't be converted as a whole. PartialBin holds the conversion of the
+% first Offset bytes of Data (counted after transfer decoding), so the caller can
+% skip or repair the bad bytes and carry on from there.
 convert_binary(_Data, _InEnc, _OutEnc, _Option) ->
 	exit(nif_library_not_loaded).
 
+% Decodes RFC 2047 encoded-words (=?Charset?B|Q?...?=) in a mail header and converts
+% the whole header to OutEnc. Text outside encoded-words is taken as ISO-8859-1.
+% Encoded-words in a charset which can't be converted are left as they are.
+% Returns {ok, ConvertedBin} when succeeded.
+decode_mime_header(_Data, _OutEnc) ->
+	exit(nif_library_not_loaded).
+
+% Same as decode_mime_header/2, but text outside encoded-words is taken as LiteralEnc;
+% e.g. "UTF-8" for headers which carry raw UTF-8 (RFC 6532).
+decode_mime_header(_Data, _OutEnc, _LiteralEnc) ->
+	exit(nif_library_not_loaded).
+
+% Returns {ok, Converter} for do_convert/2. Converter is a reference; the converter is
+% freed once no process refers to it any more, or earlier by destroy_converter/1.
+% A converter belongs to the loaded version of the NIF library: after a code upgrade,
+% the new code fails with badarg on converters created before it, so create them again.
+% They are freed when the old version is purged.
 create_converter(_InEnc, _OutEnc, _Option) ->
 	exit(nif_library_not_loaded).
 
+% Frees the converter. Using it afterwards fails with badarg. Returns ok, also for a
+% converter destroyed already or created before a code upgrade.
 destroy_converter(_Converter) ->
 	exit(nif_library_not_loaded).
 
+% Converts the next chunk of a stream. Returns {ok, ConvertedBin, RestLen}.
+% Without transfer_encoding and inflate, RestLen bytes at the end of Data were left
+% unconverted (e.g. a character split between chunks); pass them again in front of
+% the next chunk. With transfer_encoding or inflate, the converter keeps such bytes
+% itself, and RestLen only tells how many it holds; pass the next chunk as it is.
+% Such a converter returns {error, {invalid_sequence | incomplete | corrupt_stream, Offset},
+% PartialBin} once the input can't be converted any further, Offset being counted in the
+% decoded data since the last reset, and takes no more input until reset_converter/1.
 do_convert(_Data, _Converter) ->
 	exit(nif_library_not_loaded).
 
@@ -52,16 +152,27 @@ flush_converter(_Converter) ->
 reset_converter(_Converter) ->
 	exit(nif_library_not_loaded).
 
-convert_list(List, InEnc, OutEnc) ->
-	case convert_binary(list_to_binary(List), InEnc, OutEnc) of
-		{ok, Bin, Rest} -> {ok, binary_to_list(Bin), Rest};
-		{error, _}=E -> E;
-		_ -> {error, "Unexpected result."}
-	end.
+% Same as convert_binary/3, but takes an iolist and returns a list of bytes.
+% A flat list of bytes is read directly by the NIF; no intermediate binary is built.
+convert_list(_List, _InEnc, _OutEnc) ->
+	exit(nif_library_not_loaded).
+
+% Same as convert_binary/4 for lists. The result is a list of bytes, or a list of
+% Unicode code points with {output, codepoints}.
+convert_list(_List, _InEnc, _OutEnc, _Option) ->
+	exit(nif_library_not_loaded).
 
-convert_list(List, InEnc, OutEnc, Option) ->
-	case convert_binary(list_to_binary(List), InEnc, OutEnc, Option) of
-		{ok, Bin, Rest} -> {ok, binary_to_list(Bin), Rest};
-		{error, _}=E -> E;
-		_ -> {error, "Unexpected result."}
-	end.
+% Converts Data to each of OutEncs at once, decoding it only once.
+% Returns a list with one result per OutEnc, in the same order, each as convert_binary/4
+% would return it. Option is the same as for convert_binary/4. A destination which fails
+% on a character doesn't affect the others. With {fallback, {replace, Bin}}, invalid
+% input bytes become U+FFFD in the destinations which have it, and Bin in the others.
+convert_multi(_Data, _InEnc, _OutEncs, _Option) ->
+	exit(nif_library_not_loaded).
+
+% Searches Haystack (in Encoding) for Pattern (in PatternEncoding) without converting
+% Haystack. Returns {ok, [Offset]} with the byte offsets of the matches, which don't
+% overlap; byte sequences which match but begin in the middle of a character are not
+% counted. Stateful encodings such as ISO-2022-JP can't be searched.
+find(_Haystack, _Encoding, _Pattern, _PatternEncoding) ->
+	exit(nif_library_not_loaded).
@@ -10,6 +10,16 @@
 %% ===================================================================
 
 start(_StartType, _StartArgs) ->
+    % The NIF library may have been loaded before the application environment was,
+    % so open the configured pairs here as well.
+    case application:get_env(encconv, preopen) of
+        {ok, Pairs} when is_list(Pairs) -> ok = encconv:preopen(Pairs);
+        _ -> ok
+    end,
+    case application:get_env(encconv, cache) of
+        {ok, Options} when is_list(Options), Options =/= [] -> ok = encconv:cache_configure(Options);
+        _ -> ok
+    end,
     encconv_sup:start_link().
 
 stop(_State) ->
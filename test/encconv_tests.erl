@@ -0,0 +1,162 @@
+-module(encconv_tests).
+-include_lib("eunit/include/eunit.hrl").
+
+% The fallback skips a character of a stateful source without losing the shift state
+% set up by the escape sequence in front of it.
+fallback_stateful_source_test() ->
+	Data = <<"a\e$B$\"$$\e(Bz">>,
+	?assertEqual({ok, <<"a&#12354;&#12356;z">>, 0},
+		encconv:convert_binary(Data, "ISO-2022-JP", "ISO-8859-1", [{fallback, xml_charref}])),
+	?assertEqual({ok, <<"a??z">>, 0},
+		encconv:convert_binary(Data, "ISO-2022-JP", "ISO-8859-1", [{fallback, {replace, <<"?">>}}])),
+	?assertEqual({error, {incomplete, 6}, <<"a&#12354;">>},
+		encconv:convert_binary(<<"a\e$B$\"$">>, "ISO-2022-JP", "ISO-8859-1", [{fallback, xml_charref}])).
+
+% An invalid sequence in the middle of a compressed stream is reported as such, although
+% the inflater stops short of the end of the stream there.
+inflate_invalid_sequence_test() ->
+	Data = zlib:gzip([binary:copy(<<"a">>, 50000), 16#FF, binary:copy(<<"a">>, 50000)]),
+	?assertMatch({error, {invalid_sequence, 50000}, _},
+		encconv:convert_binary(Data, "UTF-8", "UTF-16BE", [{inflate, gzip}])),
+	Truncated = zlib:gzip(<<"ab", 16#E3, 16#81>>),
+	?assertEqual({error, {incomplete, 2}, <<0, $a, 0, $b>>},
+		encconv:convert_binary(Truncated, "UTF-8", "UTF-16BE", [{inflate, gzip}])).
+
+% A streaming converter which holds the input itself reports an invalid sequence,
+% and keeps reporting it rather than taking more input it can't convert.
+transfer_encoding_stream_invalid_test() ->
+	{ok, C} = encconv:create_converter("UTF-8", "UTF-16BE", [{transfer_encoding, base64}]),
+	?assertEqual({ok, <<0, $a>>, 0}, encconv:do_convert(<<"YW">>, C)),
+	?assertEqual({error, {invalid_sequence, 2}, <<0, $b>>}, encconv:do_convert(<<"L/Y2Q=">>, C)),
+	?assertEqual({error, {invalid_sequence, 2}, <<>>}, encconv:do_convert(<<"YWJj">>, C)),
+	ok = encconv:reset_converter(C),
+	?assertEqual({ok, <<0, $a, 0, $b, 0, $c>>, 0}, encconv:do_convert(<<"YWJj">>, C)),
+	encconv:destroy_converter(C).
+
+% Compressed input streamed across several do_convert/2 calls comes out whole, and an
+% invalid sequence in it stops the converter where it is.
+inflate_stream_test() ->
+	Text = binary:copy(<<"abcdefgh">>, 20000),
+	Data = zlib:gzip(Text),
+	{ok, C} = encconv:create_converter("UTF-8", "UTF-16BE", [{inflate, gzip}]),
+	Out = [begin
+		{ok, Bin, _} = encconv:do_convert(Chunk, C),
+		Bin
+	end || Chunk <- chunks(Data, 1000)],
+	?assertEqual(encconv:convert_binary(Text, "UTF-8", "UTF-16BE"), {ok, iolist_to_binary(Out), 0}),
+	ok = encconv:reset_converter(C),
+	Bad = zlib:gzip([binary:copy(<<"a">>, 30000), 16#FF, Text]),
+	Results = [encconv:do_convert(Chunk, C) || Chunk <- chunks(Bad, 100)],
+	?assertMatch({error, {invalid_sequence, 30000}, _}, lists:last(Results)),
+	encconv:destroy_converter(C).
+
+chunks(Bin, Size) when byte_size(Bin) =< Size ->
+	[Bin];
+chunks(Bin, Size) ->
+	<<Chunk:Size/binary, Rest/binary>> = Bin,
+	[Chunk | chunks(Rest, Size)].
+
+% Lists are read directly when they hold bytes only, and taken as iolists otherwise.
+convert_list_iolist_test() ->
+	?assertEqual({ok, [0, $a, 0, $b, 0, $c], 0}, encconv:convert_list([$a, $b, $c], "UTF-8", "UTF-16BE")),
+	?assertEqual({ok, [0, $a, 0, $b, 0, $c], 0}, encconv:convert_list(["ab", $c], "UTF-8", "UTF-16BE")),
+	?assertEqual({ok, [0, $a, 0, $b, 0, $c], 0}, encconv:convert_list([$a, <<"bc">>], "UTF-8", "UTF-16BE", [])),
+	?assertError(badarg, encconv:convert_list([$a, 300], "UTF-8", "UTF-16BE")).
+
+% Encoded-words in different charsets are decoded in one header. Whitespace between two
+% encoded-words goes, a character may be split between them, and a word in a charset
+% which can't be converted is left as it is.
+decode_mime_header_test() ->
+	A = <<16#E3, 16#81, 16#82>>,
+	?assertEqual({ok, <<A/binary, 16#E3, 16#81, 16#84, 16#E3, 16#81, 16#86, " and caf", 16#C3, 16#A9>>},
+		encconv:decode_mime_header(<<"=?ISO-2022-JP?B?GyRCJCIkJCQmGyhC?= and =?UTF-8?Q?caf=C3=A9?=">>, "UTF-8")),
+	?assertEqual({ok, <<A/binary, 16#E3, 16#81, 16#84>>},
+		encconv:decode_mime_header(<<"=?UTF-8?B?44GC?= =?UTF-8?B?44GE?=">>, "UTF-8")),
+	?assertEqual({ok, A}, encconv:decode_mime_header(<<"=?UTF-8?Q?=E3=81?= =?UTF-8?Q?=82?=">>, "UTF-8")),
+	?assertEqual({ok, A}, encconv:decode_mime_header(<<"=?UTF-8?B?4w==?= =?UTF-8?B?gYI=?=">>, "UTF-8")),
+	?assertEqual({ok, <<"a =?X-NOPE?B?YWJj?= b">>},
+		encconv:decode_mime_header(<<"a =?X-NOPE?B?YWJj?= b">>, "UTF-8")),
+	?assertEqual({ok, <<"a b">>}, encconv:decode_mime_header(<<"=?utf-8?q?a_b?=">>, "UTF-8")),
+	?assertEqual({ok, <<"caf", 16#C3, 16#A9, " ", A/binary>>},
+		encconv:decode_mime_header(<<"caf", 16#E9, " =?UTF-8?Q?=E3=81=82?=">>, "UTF-8")),
+	?assertEqual({ok, <<"caf", 16#C3, 16#A9, " ", A/binary>>},
+		encconv:decode_mime_header(<<"caf", 16#C3, 16#A9, " =?UTF-8?Q?=E3=81=82?=">>, "UTF-8", "UTF-8")).
+
+% Base64 and Quoted-Printable split anywhere between do_convert/2 calls come out as if
+% they had been given at once.
+transfer_encoding_stream_test() ->
+	{ok, B} = encconv:create_converter("UTF-8", "UTF-16BE", [{transfer_encoding, base64}]),
+	?assertEqual({ok, <<>>, 0}, encconv:do_convert(<<"4">>, B)),
+	?assertEqual({ok, <<>>, 2}, encconv:do_convert(<<"4G">>, B)),
+	?assertEqual({ok, <<16#30, 16#42>>, 1}, encconv:do_convert(<<"C44">>, B)),
+	?assertEqual({ok, <<16#30, 16#44>>, 0}, encconv:do_convert(<<"GE">>, B)),
+	encconv:destroy_converter(B),
+	{ok, Q} = encconv:create_converter("UTF-8", "UTF-16BE", [{transfer_encoding, quoted_printable}]),
+	?assertEqual({ok, <<0, $c, 0, $a, 0, $f>>, 0}, encconv:do_convert(<<"caf=">>, Q)),
+	?assertEqual({ok, <<>>, 1}, encconv:do_convert(<<"C3=A">>, Q)),
+	?assertEqual({ok, <<0, 16#E9, 0, $\s, 0, $x>>, 0}, encconv:do_convert(<<"9 =\r\nx">>, Q)),
+	encconv:destroy_converter(Q).
+
+% find/4 only counts matches which begin at a character boundary, and they don't overlap.
+find_boundary_test() ->
+	?assertEqual({ok, [2]}, encconv:find(<<16#83, "AA">>, "SHIFT_JIS", <<"A">>, "ASCII")),
+	?assertEqual({ok, [0, 2]}, encconv:find(<<"aaaa">>, "ASCII", <<"aa">>, "ASCII")),
+	?assertEqual({ok, [1, 4]},
+		encconv:find(<<"x", 16#83, 16#41, "y", 16#83, 16#41>>, "SHIFT_JIS", <<16#E3, 16#82, 16#A2>>, "UTF-8")),
+	?assertEqual({ok, [0]},
+		encconv:find(<<16#30, 16#42, 16#42, 16#30, 16#42, 16#30>>, "UTF-16BE", <<16#E3, 16#81, 16#82>>, "UTF-8")),
+	?assertEqual({ok, []}, encconv:find(<<"abc">>, "UTF-8", <<16#E3, 16#81, 16#82>>, "UTF-8")),
+	?assertMatch({error, _}, encconv:find(<<"\e$B$\"\e(B">>, "ISO-2022-JP", <<"a">>, "ASCII")).
+
+% {output, iolist} cuts the result into binaries of 65536 bytes, and {output, codepoints}
+% gives code points, in the partial result of an error as well.
+output_format_test() ->
+	Text = binary:copy(<<"a">>, 70000),
+	{ok, Bins, 0} = encconv:convert_binary(Text, "UTF-8", "UTF-16BE", [{output, iolist}]),
+	?assertEqual([65536, 65536, 8928], [byte_size(Bin) || Bin <- Bins]),
+	?assertEqual(encconv:convert_binary(Text, "UTF-8", "UTF-16BE", []), {ok, iolist_to_binary(Bins), 0}),
+	?assertEqual({ok, [], 0}, encconv:convert_binary(<<>>, "UTF-8", "UTF-16BE", [{output, iolist}])),
+	?assertEqual({ok, [$a, 16#3042], 0},
+		encconv:convert_binary(<<"a", 16#82, 16#A0>>, "SHIFT_JIS", "UTF-8", [{output, codepoints}])),
+	?assertEqual({error, {invalid_sequence, 3}, [$a, 16#3042]},
+		encconv:convert_binary(<<"a", 16#82, 16#A0, 16#FF>>, "SHIFT_JIS", "UTF-8", [{output, codepoints}])),
+	?assertEqual({ok, [$a, 16#3042], 0},
+		encconv:convert_list([$a, 16#82, 16#A0], "SHIFT_JIS", "UTF-8", [{output, codepoints}])),
+	?assertMatch({error, _}, encconv:convert_binary(<<"a">>, "UTF-8", "ISO-8859-1", [{output, codepoints}])).
+
+% Results are cached by input, encodings and options while the cache is on, and only
+% for {output, binary}.
+result_cache_test() ->
+	ok = encconv:cache_configure([{max_memory, 100000}]),
+	ok = encconv:cache_clear(),
+	Hits = proplists:get_value(hits, encconv:cache_info()),
+	Expected = {ok, <<0, $a, 0, $b, 0, $c>>, 0},
+	?assertEqual(Expected, encconv:convert_binary(<<"abc">>, "UTF-8", "UTF-16BE")),
+	?assertEqual(Expected, encconv:convert_binary(<<"abc">>, "UTF-8", "UTF-16BE")),
+	?assertEqual({ok, <<$a, 0, $b, 0, $c, 0>>, 0}, encconv:convert_binary(<<"abc">>, "UTF-8", "UTF-16LE")),
+	?assertEqual({ok, [<<0, $a, 0, $b, 0, $c>>], 0},
+		encconv:convert_binary(<<"abc">>, "UTF-8", "UTF-16BE", [{output, iolist}])),
+	Info = encconv:cache_info(),
+	?assertEqual(Hits + 1, proplists:get_value(hits, Info)),
+	?assertEqual(2, proplists:get_value(entries, Info)),
+	ok = encconv:cache_clear(),
+	ok = encconv:cache_configure([{max_memory, 0}]),
+	?assertEqual(Expected, encconv:convert_binary(<<"abc">>, "UTF-8", "UTF-16BE")),
+	?assertEqual(0, proplists:get_value(entries, encconv:cache_info())),
+	?assertError(badarg, encconv:cache_configure([{bogus, 0}])).
+
+% convert_multi/4 gives each destination what convert_binary/4 would, and a destination
+% which fails doesn't affect the others.
+convert_multi_test() ->
+	Data = <<"a", 16#E3, 16#81, 16#82, 16#E2, 16#82, 16#AC>>,
+	[Latin1, Sjis, Utf16, Unknown] =
+		encconv:convert_multi(Data, "UTF-8", ["ISO-8859-1", "SHIFT_JIS", "UTF-16BE", "X-NOPE"], []),
+	?assertEqual({error, {invalid_sequence, 1}, <<"a">>}, Latin1),
+	?assertEqual(encconv:convert_binary(Data, "UTF-8", "SHIFT_JIS", []), Sjis),
+	?assertEqual(encconv:convert_binary(Data, "UTF-8", "UTF-16BE", []), Utf16),
+	?assertMatch({error, _}, Unknown),
+	?assertEqual([{ok, <<"a&#12354;&#8364;">>, 0}, {ok, <<"a", 16#82, 16#A0, "&#8364;">>, 0}],
+		encconv:convert_multi(Data, "UTF-8", ["ISO-8859-1", "SHIFT_JIS"], [{fallback, xml_charref}])),
+	?assertEqual([{ok, <<"a?">>, 0}, {ok, <<0, $a, 16#FF, 16#FD>>, 0}],
+		encconv:convert_multi(<<"a", 16#FF>>, "UTF-8", ["ISO-8859-1", "UTF-16BE"], [{fallback, {replace, <<"?">>}}])),
+	?assertMatch({error, _}, encconv:convert_multi(Data, "X-NOPE", ["UTF-8"], [])).